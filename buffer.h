@@ -51,6 +51,35 @@ namespace NETWORK_POOL
 			m_maxLength = m_length = 0;
 		}
 
+		inline void adopt(uv_buf_t& buf) // Internal use only, and buf must be allocated by trace.
+		{
+			m_trace->_free_set_nullptr(m_data); // No need to check nullptr.
+			m_data = buf.base;
+			m_maxLength = m_length = buf.len;
+			buf.base = nullptr;
+			buf.len = 0;
+		}
+
+		// Grow geometrically(no more than limit) and take the whole block, so growing byte by byte is amortized O(1).
+		inline void grow(size_t maxLength, const size_t copy, const size_t limit)
+		{
+			const size_t least = maxLength;
+			if (maxLength < m_maxLength * 2)
+				maxLength = m_maxLength * 2;
+			maxLength = CmemoryTrace::_usable_size(maxLength);
+			if (maxLength > limit)
+				maxLength = limit > least ? limit : least;
+			if (copy > 0)
+				m_data = m_trace->_realloc_throw(m_data, maxLength); // In place if allocator allows.
+			else
+			{
+				m_trace->_free_set_nullptr(m_data); // No need to check nullptr.
+				m_maxLength = m_length = 0; // In case of throw.
+				m_data = m_trace->_malloc_throw(maxLength, tag_buffer);
+			}
+			m_maxLength = maxLength;
+		}
+
 		friend void on_wakeup(uv_async_t *async);
 		friend class CnetworkPool;
 
@@ -67,7 +96,7 @@ namespace NETWORK_POOL
 			}
 			else
 			{
-				m_data = m_trace->_malloc_throw(length);
+				m_data = m_trace->_malloc_throw(length, tag_buffer);
 				m_maxLength = m_length = length;
 			}
 		}
@@ -81,7 +110,7 @@ namespace NETWORK_POOL
 			}
 			else
 			{
-				m_data = m_trace->_malloc_throw(length);
+				m_data = m_trace->_malloc_throw(length, tag_buffer);
 				memcpy(m_data, data, length);
 				m_maxLength = m_length = length;
 			}
@@ -96,7 +125,7 @@ namespace NETWORK_POOL
 			}
 			else
 			{
-				m_data = m_trace->_malloc_throw(another.m_length);
+				m_data = m_trace->_malloc_throw(another.m_length, tag_buffer);
 				memcpy(m_data, another.m_data, another.m_length);
 				m_maxLength = m_length = another.m_length;
 			}
@@ -124,7 +153,7 @@ namespace NETWORK_POOL
 			else
 			{
 				m_trace->_free_set_nullptr(m_data); // No need to check nullptr.
-				m_data = m_trace->_malloc_throw(another.m_length);
+				m_data = m_trace->_malloc_throw(another.m_length, tag_buffer);
 				memcpy(m_data, another.m_data, another.m_length);
 				m_maxLength = m_length = another.m_length;
 			}
@@ -154,7 +183,7 @@ namespace NETWORK_POOL
 			else
 			{
 				m_trace->_free_set_nullptr(m_data); // No need to check nullptr.
-				m_data = m_trace->_malloc_throw(length);
+				m_data = m_trace->_malloc_throw(length, tag_buffer);
 				memcpy(m_data, data, length);
 				m_maxLength = m_length = length;
 			}
@@ -162,29 +191,44 @@ namespace NETWORK_POOL
 
 		inline void resize(const size_t preferLength, const size_t validLength = 0)
 		{
-			if (preferLength <= m_maxLength)
+			if (preferLength > m_maxLength)
+				grow(preferLength, validLength > m_length ? m_length : validLength, (size_t)-1);
+			m_length = preferLength;
+		}
+
+		// Make capacity at least maxLength, and keep the data.
+		// Capacity grows geometrically but never over limit(unless maxLength is over it).
+		inline void reserve(const size_t maxLength, const size_t limit = (size_t)-1)
+		{
+			if (maxLength > m_maxLength)
+				grow(maxLength, m_length, limit);
+		}
+
+		// Give back capacity over length(e.g. after a large message), and keep the data.
+		inline void shrinkToFit()
+		{
+			if (0 == m_length)
 			{
-				m_length = preferLength;
+				m_trace->_free_set_nullptr(m_data); // No need to check nullptr.
+				m_maxLength = 0;
 				return;
 			}
-			// We need to enlarge the buffer.
-			size_t copy = validLength > m_length ? m_length : validLength;
-			if (copy > 0)
+			const size_t maxLength = CmemoryTrace::_usable_size(m_length);
+			if (maxLength >= m_maxLength)
+				return;
+			void *newBuffer = m_trace->_realloc_no_throw(m_data, maxLength);
+			if (newBuffer != nullptr) // Keep the old one if failed.
 			{
-				void *newBuffer = m_trace->_malloc_throw(preferLength);
-				memcpy(newBuffer, m_data, copy);
-				m_trace->_free_set_nullptr(m_data);
 				m_data = newBuffer;
-				m_maxLength = m_length = preferLength;
-			}
-			else
-			{
-				m_trace->_free_set_nullptr(m_data); // No need to check nullptr.
-				m_data = m_trace->_malloc_throw(preferLength);
-				m_maxLength = m_length = preferLength;
+				m_maxLength = maxLength;
 			}
 		}
 
+		inline CmemoryTrace *getTrace() const
+		{
+			return m_trace;
+		}
+
 		inline void *getData() const
 		{
 			return m_data;
@@ -19,17 +19,18 @@
  * SOFTWARE.
  */
 
+#include <atomic>
 #include <mutex>
 #include <thread>
 #include <cstdlib>
-
-#include "uv.h"
+#include <cstring>
+#ifdef _MSC_VER
+	#include <malloc.h>
+#else
+	#include <sys/mman.h>
+#endif
 
 #include "fast_allocator.h"
-#include "network_node.h"
-#include "buffer.h"
-#include "network_pool.h"
-#include "uv_wrapper.h"
 
 #define FA_DBG 0
 #if FA_DBG
@@ -41,50 +42,367 @@
 
 namespace NETWORK_POOL
 {
-	static const size_t s_maxAllocatorSlot = 4096;
-	#define set_max_store_number(_s, _n) { if ((_s) < s_maxAllocatorSlot) s_maxAllocatorStoreNumber[(_s)] = (_n); }
+	//
+	// Slab allocator with geometric size classes(32 bytes, then 16 bytes step up to 128, then 4 classes per power of 2 up to 64KB).
+	// Blocks of a class are carved from large chunks in batches, and chunk blocks never return to system, so no fragmentation.
+	// Freed blocks are cached in a per thread magazine first, so the common alloc/free takes no lock.
+	// Magazine exchanges batches of blocks with the depot(shared by all threads) when it's empty or too full.
+	// Block in cache is list node: next block, next batch(depot only) and number of blocks in batch(depot only).
+	// Each class has a limit of blocks carved and cached in depot, and over the limit malloc is used and freed to system.
+	//
+	static const size_t s_maxClassSize = 65536; // Larger goes to malloc.
+	static const size_t s_maxAllocatorClass = 48;
+	static const size_t s_chunkSize = 2 << 20; // Chunk is aligned to its size, so chunk of block is known by address, and it's a huge page.
+	static const size_t s_maxChunkNumber = 1 << 16;
+	static const size_t s_slabSize = 65536; // Carve at most this(and at most s_batchSize blocks) at a time.
+	static const size_t s_batchSize = 32; // Blocks moved between magazine and depot at a time.
+	static const size_t s_pageSize = 4096; // Smallest page, for pre-faulting.
+	static const size_t s_defaultClassBytes = 4 << 20; // Default limit of a class, and chunk blocks never return to system, so keep it small.
+
+	struct __block
+	{
+		__block *m_next;
+		__block *m_nextBatch;
+		size_t m_batchCount;
+	};
+
+	struct __depot
+	{
+		std::mutex m_lock;
+		__block *m_batches;
+		size_t m_count; // Blocks in all batches.
+		size_t m_size; // Block size.
+		size_t m_batch; // Blocks in a full batch.
+		size_t m_limit; // Max blocks carved, and max blocks in depot.
+		// Statistics(under m_lock).
+		size_t m_carved;
+		uint64_t m_hit; // Of exited threads.
+		uint64_t m_refill;
+		uint64_t m_carve;
+		uint64_t m_fallback;
+		uint64_t m_flush;
+		uint64_t m_release;
+	};
 
-	static std::mutex s_globalLock;
-	static void *s_allocatorStore[s_maxAllocatorSlot] = { 0 };
-	static size_t s_allocatorStoreCount[s_maxAllocatorSlot] = { 0 };
-	static size_t s_maxAllocatorStoreNumber[s_maxAllocatorSlot] = { 0 };
+	static uint8_t s_sizeClass[s_maxClassSize / 16 + 1]; // Index by (size + 15) / 16.
+	static __depot s_depot[s_maxAllocatorClass];
+	static size_t s_classNumber = 0;
 
-	static std::once_flag s_storeNumberInit;
+	// Chunk being carved, and set of chunks(open addressing by address).
+	static std::mutex s_chunkLock;
+	static char *s_chunk = nullptr;
+	static size_t s_chunkLeft = 0;
+	static size_t s_chunkNumber = 0;
+	static uintptr_t s_chunks[s_maxChunkNumber * 2];
 
-	static inline void initStoreNumber()
+	static std::once_flag s_classInit;
+
+	static inline void initClass()
 	{
-		std::call_once(s_storeNumberInit, []()
+		std::call_once(s_classInit, []()
 		{
-			set_max_store_number(sizeof(CnetworkNode), 512);
-			set_max_store_number(sizeof(Cbuffer), 512);
-			set_max_store_number(sizeof(uv_shutdown_t) + sizeof(size_t), 1024);
-			set_max_store_number(sizeof(uv_connect_t) + sizeof(size_t), 1024);
-			set_max_store_number(sizeof(CnetworkPool::__write_with_info) + sizeof(size_t), 4096);
-			set_max_store_number(sizeof(CnetworkPool::__udp_send_with_info) + sizeof(size_t), 4096);
-			set_max_store_number(sizeof(Casync) + sizeof(size_t), 0);
-			set_max_store_number(sizeof(Ctcp) + sizeof(size_t), 16384);
-			set_max_store_number(sizeof(Cudp) + sizeof(size_t), 0);
+			size_t size = 32; // At least list node of block.
+			static_assert(sizeof(__block) <= 32, "Block of the smallest class must hold list node.");
+			while (size <= s_maxClassSize)
+			{
+				__depot& depot = s_depot[s_classNumber];
+				depot.m_size = size;
+				depot.m_batch = s_slabSize / size;
+				if (depot.m_batch > s_batchSize)
+					depot.m_batch = s_batchSize;
+				else if (0 == depot.m_batch)
+					depot.m_batch = 1;
+				depot.m_limit = s_defaultClassBytes / size;
+				for (size_t i = (s_classNumber > 0 ? s_depot[s_classNumber - 1].m_size : 0) / 16 + 1; i <= size / 16; ++i)
+					s_sizeClass[i] = (uint8_t)s_classNumber;
+				++s_classNumber;
+				if (size < 128)
+					size += 16;
+				else
+				{
+					size_t power = 128;
+					while (power * 2 <= size)
+						power *= 2;
+					size += power / 4;
+				}
+			}
+			s_sizeClass[0] = 0;
 		});
 	}
 
+	// Following chunk function(s) are called under s_chunkLock.
+	static inline size_t chunkSlot(const uintptr_t chunk)
+	{
+		return (size_t)((chunk / s_chunkSize) * 0x9e3779b97f4a7c15ull >> 40) & (s_maxChunkNumber * 2 - 1);
+	}
+
+	static inline bool isChunkBlock(const void *ptr)
+	{
+		const uintptr_t chunk = (uintptr_t)ptr & ~(uintptr_t)(s_chunkSize - 1);
+		for (size_t slot = chunkSlot(chunk); s_chunks[slot] != 0; slot = (slot + 1) & (s_maxChunkNumber * 2 - 1))
+		{
+			if (s_chunks[slot] == chunk)
+				return true;
+		}
+		return false;
+	}
+
+	static bool s_bHugePage = false;
+
+	// Reserve chunk with mmap(trimmed to alignment) and ask for huge page, return nullptr to fall back.
+	static inline void *mapHugeChunk()
+	{
+	#if defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+		char *region = (char *)mmap(nullptr, s_chunkSize * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (MAP_FAILED == region)
+			return nullptr;
+		char *chunk = (char *)(((uintptr_t)region + s_chunkSize - 1) & ~(uintptr_t)(s_chunkSize - 1));
+		if (chunk > region)
+			munmap(region, chunk - region);
+		if (region + s_chunkSize * 2 > chunk + s_chunkSize)
+			munmap(chunk + s_chunkSize, region + s_chunkSize * 2 - (chunk + s_chunkSize));
+		madvise(chunk, s_chunkSize, MADV_HUGEPAGE); // Just advice, and pages are 4KB if huge page is disabled.
+		return chunk;
+	#else
+		return nullptr;
+	#endif
+	}
+
+	static inline char *newChunk()
+	{
+		if (s_chunkNumber >= s_maxChunkNumber)
+			return nullptr;
+		void *chunk = s_bHugePage ? mapHugeChunk() : nullptr;
+		if (nullptr == chunk)
+		{
+		#ifdef _MSC_VER
+			chunk = _aligned_malloc(s_chunkSize, s_chunkSize);
+		#else
+			if (posix_memalign(&chunk, s_chunkSize, s_chunkSize) != 0)
+				chunk = nullptr;
+		#endif
+		}
+		if (nullptr == chunk)
+			return nullptr;
+		size_t slot = chunkSlot((uintptr_t)chunk);
+		while (s_chunks[slot] != 0)
+			slot = (slot + 1) & (s_maxChunkNumber * 2 - 1);
+		s_chunks[slot] = (uintptr_t)chunk;
+		++s_chunkNumber;
+		return (char *)chunk;
+	}
+
+	// Carve blocks from chunk, and return a batch of blocks(nullptr if over limit or insufficient memory).
+	static __block *carve(__depot& depot, size_t& count)
+	{
+		{
+			std::lock_guard<std::mutex> guard(depot.m_lock);
+			if (depot.m_carved >= depot.m_limit)
+			{
+				++depot.m_fallback;
+				return nullptr;
+			}
+			count = depot.m_limit - depot.m_carved;
+		}
+		char *ptr = nullptr;
+		{
+			std::lock_guard<std::mutex> guard(s_chunkLock);
+			if (s_chunkLeft < depot.m_size)
+			{
+				// Rest of chunk is wasted(less than a block).
+				char *chunk = newChunk();
+				if (chunk != nullptr)
+				{
+					s_chunk = chunk;
+					s_chunkLeft = s_chunkSize;
+				}
+			}
+			if (s_chunkLeft < depot.m_size)
+				count = 0;
+			else if (count > s_chunkLeft / depot.m_size)
+				count = s_chunkLeft / depot.m_size;
+			if (count > depot.m_batch)
+				count = depot.m_batch;
+			ptr = s_chunk;
+			s_chunk += count * depot.m_size;
+			s_chunkLeft -= count * depot.m_size;
+		}
+		if (0 == count)
+		{
+			std::lock_guard<std::mutex> guard(depot.m_lock);
+			++depot.m_fallback;
+			return nullptr;
+		}
+		__block *head = (__block *)ptr;
+		for (size_t i = 1; i < count; ++i)
+		{
+			((__block *)ptr)->m_next = (__block *)(ptr + depot.m_size);
+			ptr += depot.m_size;
+		}
+		((__block *)ptr)->m_next = nullptr;
+		{
+			std::lock_guard<std::mutex> guard(depot.m_lock);
+			depot.m_carved += count;
+			++depot.m_carve;
+		}
+		return head;
+	}
+
+	// Depot operations, batch is a list of blocks.
+	static inline __block *takeBatch(__depot& depot, size_t& count)
+	{
+		{
+			std::lock_guard<std::mutex> guard(depot.m_lock);
+			__block *batch = depot.m_batches;
+			if (batch != nullptr)
+			{
+				depot.m_batches = batch->m_nextBatch;
+				count = batch->m_batchCount;
+				depot.m_count -= count;
+				++depot.m_refill;
+				return batch;
+			}
+		}
+		return carve(depot, count);
+	}
+
+	static inline void giveBatch(__depot& depot, __block *batch, size_t count)
+	{
+		__block *release = nullptr;
+		{
+			std::lock_guard<std::mutex> guard(depot.m_lock);
+			if (depot.m_count + count > depot.m_limit)
+			{
+				// Over limit, blocks from malloc are freed, and chunk blocks(no more than limit) are kept.
+				std::lock_guard<std::mutex> chunkGuard(s_chunkLock);
+				__block *keep = nullptr;
+				count = 0;
+				while (batch != nullptr)
+				{
+					__block *next = batch->m_next;
+					if (isChunkBlock(batch))
+					{
+						batch->m_next = keep;
+						keep = batch;
+						++count;
+					}
+					else
+					{
+						batch->m_next = release;
+						release = batch;
+						++depot.m_release;
+					}
+					batch = next;
+				}
+				batch = keep;
+			}
+			if (batch != nullptr)
+			{
+				batch->m_nextBatch = depot.m_batches;
+				batch->m_batchCount = count;
+				depot.m_batches = batch;
+				depot.m_count += count;
+				++depot.m_flush;
+			}
+		}
+		while (release != nullptr)
+		{
+			__block *next = release->m_next;
+			free(release);
+			release = next;
+		}
+	}
+
+	// Owned by a thread, and POD, so no guard on access. Flushed by __thread_cache_flusher when thread exits.
+	struct __thread_cache
+	{
+		__block *m_head[s_maxAllocatorClass];
+		size_t m_count[s_maxAllocatorClass];
+		std::atomic<uint64_t> m_hit[s_maxAllocatorClass]; // Only written by owner thread, and read by statistics.
+		__thread_cache *m_prev;
+		__thread_cache *m_next;
+		bool m_bRegistered;
+		bool m_bExited;
+	};
+	static thread_local __thread_cache s_cache;
+
+	// Live thread caches.
+	static std::mutex s_cacheListLock;
+	static __thread_cache *s_cacheList = nullptr;
+
+	struct __thread_cache_flusher
+	{
+		~__thread_cache_flusher()
+		{
+			{
+				std::lock_guard<std::mutex> guard(s_cacheListLock);
+				if (s_cache.m_prev != nullptr)
+					s_cache.m_prev->m_next = s_cache.m_next;
+				else
+					s_cacheList = s_cache.m_next;
+				if (s_cache.m_next != nullptr)
+					s_cache.m_next->m_prev = s_cache.m_prev;
+				for (size_t i = 0; i < s_classNumber; ++i)
+				{
+					std::lock_guard<std::mutex> depotGuard(s_depot[i].m_lock);
+					s_depot[i].m_hit += s_cache.m_hit[i].load(std::memory_order_relaxed);
+				}
+			}
+			for (size_t i = 0; i < s_classNumber; ++i)
+			{
+				if (s_cache.m_head[i] != nullptr)
+					giveBatch(s_depot[i], s_cache.m_head[i], s_cache.m_count[i]);
+				s_cache.m_head[i] = nullptr;
+				s_cache.m_count[i] = 0;
+			}
+			s_cache.m_bExited = true; // Alloc and free after this go to depot directly.
+		}
+	};
+	static thread_local __thread_cache_flusher s_cacheFlusher;
+
+	static inline void registerFlusher()
+	{
+		if (!s_cache.m_bRegistered)
+		{
+			s_cache.m_bRegistered = true;
+			(void)&s_cacheFlusher; // Construct it, so it's destructed when thread exits.
+			std::lock_guard<std::mutex> guard(s_cacheListLock);
+			s_cache.m_prev = nullptr;
+			s_cache.m_next = s_cacheList;
+			if (s_cacheList != nullptr)
+				s_cacheList->m_prev = &s_cache;
+			s_cacheList = &s_cache;
+		}
+	}
+
 	void *__alloc(std::size_t size)
 	{
-		initStoreNumber();
 		FA_FPRINTF((stderr, "fa alloc %u.\n", size));
-		if (size >= s_maxAllocatorSlot || 0 == s_maxAllocatorStoreNumber[size])
+		if (size > s_maxClassSize)
 			return malloc(size);
-		FA_FPRINTF((stderr, "fa use store.\n"));
-		void *take = nullptr;
-		s_globalLock.lock();
-		if (s_allocatorStore[size] != nullptr)
+		initClass();
+		const size_t index = s_sizeClass[(size + 15) / 16];
+		__block *take = s_cache.m_head[index];
+		if (take != nullptr)
 		{
-			take = s_allocatorStore[size];
-			s_allocatorStore[size] = *(void **)take;
-			--s_allocatorStoreCount[size];
+			s_cache.m_head[index] = take->m_next;
+			--s_cache.m_count[index];
+			s_cache.m_hit[index].store(s_cache.m_hit[index].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			return take;
 		}
-		s_globalLock.unlock();
+		// Refill from depot or chunk.
+		size_t count;
+		take = takeBatch(s_depot[index], count);
 		if (nullptr == take)
-			return malloc(size < sizeof(void *) ? sizeof(void *) : size); // At least a pointer for linked list.
+			return malloc(s_depot[index].m_size); // Over limit or insufficient memory for chunk, and it's cached as block of class when free.
+		if (!s_cache.m_bExited)
+		{
+			registerFlusher();
+			s_cache.m_head[index] = take->m_next;
+			s_cache.m_count[index] = count - 1;
+		}
+		else if (take->m_next != nullptr)
+			giveBatch(s_depot[index], take->m_next, count - 1); // Give back the rest.
 		return take;
 	}
 
@@ -93,19 +411,139 @@ namespace NETWORK_POOL
 		if (nullptr == ptr)
 			return;
 		FA_FPRINTF((stderr, "fa free %u.\n", size));
-		if (size >= s_maxAllocatorSlot || 0 == s_maxAllocatorStoreNumber[size])
+		if (size > s_maxClassSize)
 			return free(ptr);
-		FA_FPRINTF((stderr, "fa use store.\n"));
-		s_globalLock.lock();
-		if (s_allocatorStoreCount[size] < s_maxAllocatorStoreNumber[size])
-		{
-			*(void **)ptr = s_allocatorStore[size];
-			s_allocatorStore[size] = ptr;
-			++s_allocatorStoreCount[size];
-			ptr = nullptr;
-		}
-		s_globalLock.unlock();
-		if (ptr != nullptr)
-			free(ptr);
+		const size_t index = s_sizeClass[(size + 15) / 16];
+		__block *block = (__block *)ptr;
+		if (s_cache.m_bExited)
+		{
+			block->m_next = nullptr;
+			giveBatch(s_depot[index], block, 1);
+			return;
+		}
+		registerFlusher();
+		block->m_next = s_cache.m_head[index];
+		s_cache.m_head[index] = block;
+		const size_t batch = s_depot[index].m_batch;
+		if (++s_cache.m_count[index] >= 2 * batch)
+		{
+			// Too many, flush a batch to depot.
+			__block *last = block;
+			for (size_t i = 1; i < batch; ++i)
+				last = last->m_next;
+			s_cache.m_head[index] = last->m_next;
+			s_cache.m_count[index] -= batch;
+			last->m_next = nullptr;
+			giveBatch(s_depot[index], block, batch);
+		}
+	}
+
+	std::size_t __alloc_size(std::size_t size)
+	{
+		if (size > s_maxClassSize)
+			return size;
+		initClass();
+		return s_depot[s_sizeClass[(size + 15) / 16]].m_size;
+	}
+
+	void *__realloc(void *ptr, std::size_t oldSize, std::size_t newSize)
+	{
+		if (nullptr == ptr)
+			return __alloc(newSize);
+		if (oldSize > s_maxClassSize && newSize > s_maxClassSize)
+			return realloc(ptr, newSize); // Large block may be remapped in place.
+		if (__alloc_size(oldSize) == __alloc_size(newSize))
+			return ptr;
+		void *newPtr = __alloc(newSize);
+		if (nullptr == newPtr)
+			return nullptr;
+		memcpy(newPtr, ptr, oldSize < newSize ? oldSize : newSize);
+		__free(ptr, oldSize);
+		return newPtr;
+	}
+
+	bool __allocator_set_limit(const std::size_t size, const std::size_t number)
+	{
+		if (size > s_maxClassSize)
+			return false;
+		initClass();
+		__depot& depot = s_depot[s_sizeClass[(size + 15) / 16]];
+		std::lock_guard<std::mutex> guard(depot.m_lock);
+		depot.m_limit = number;
+		return true;
+	}
+
+	bool __allocator_enable_huge_page(const bool bEnable)
+	{
+		std::lock_guard<std::mutex> guard(s_chunkLock);
+		s_bHugePage = bEnable;
+	#if defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+		return true;
+	#else
+		return !bEnable;
+	#endif
+	}
+
+	size_t __allocator_reserve(const std::size_t size, const std::size_t number)
+	{
+		if (size > s_maxClassSize)
+			return 0;
+		initClass();
+		__depot& depot = s_depot[s_sizeClass[(size + 15) / 16]];
+		{
+			// Raise the limit, so blocks reserved are kept in cache.
+			std::lock_guard<std::mutex> guard(depot.m_lock);
+			if (depot.m_limit < depot.m_carved + number)
+				depot.m_limit = depot.m_carved + number;
+		}
+		size_t reserved = 0;
+		while (reserved < number)
+		{
+			size_t count;
+			__block *batch = carve(depot, count);
+			if (nullptr == batch)
+				break;
+			// Touch each page, so page faults are taken now instead of on first use.
+			for (__block *block = batch; block != nullptr; block = block->m_next)
+			{
+				for (size_t offset = s_pageSize; offset < depot.m_size; offset += s_pageSize)
+					((volatile char *)block)[offset] = 0;
+			}
+			giveBatch(depot, batch, count);
+			reserved += count;
+		}
+		return reserved;
+	}
+
+	size_t __allocator_stats(__allocator_class_stats *stats, const std::size_t number)
+	{
+		initClass();
+		std::lock_guard<std::mutex> guard(s_cacheListLock);
+		for (size_t i = 0; i < number && i < s_classNumber; ++i)
+		{
+			__depot& depot = s_depot[i];
+			uint64_t hit = 0;
+			for (__thread_cache *cache = s_cacheList; cache != nullptr; cache = cache->m_next)
+				hit += cache->m_hit[i].load(std::memory_order_relaxed);
+			std::lock_guard<std::mutex> depotGuard(depot.m_lock);
+			stats[i].m_size = depot.m_size;
+			stats[i].m_limit = depot.m_limit;
+			stats[i].m_carved = depot.m_carved;
+			stats[i].m_cached = depot.m_count;
+			stats[i].m_hit = depot.m_hit + hit;
+			stats[i].m_miss = depot.m_refill + depot.m_carve + depot.m_fallback;
+			stats[i].m_refill = depot.m_refill;
+			stats[i].m_carve = depot.m_carve;
+			stats[i].m_fallback = depot.m_fallback;
+			stats[i].m_flush = depot.m_flush;
+			stats[i].m_release = depot.m_release;
+		}
+		return s_classNumber;
+	}
+
+	size_t __allocator_chunk_bytes()
+	{
+		std::lock_guard<std::mutex> guard(s_chunkLock);
+		return s_chunkNumber * s_chunkSize;
 	}
 }
@@ -22,11 +22,55 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 
 namespace NETWORK_POOL
 {
+	// Size must be the same as alloc when free.
 	void *__alloc(std::size_t size);
 	void __free(void *ptr, std::size_t size);
+	// Size of block serving size, and whole block is usable.
+	std::size_t __alloc_size(std::size_t size);
+	// Resize block to newSize and keep content, in place when both sizes are served by the same block(or by realloc).
+	// Return nullptr if failed, and ptr is still valid then.
+	void *__realloc(void *ptr, std::size_t oldSize, std::size_t newSize);
+
+	//
+	// Allocator is shared by the process, sizes up to 64KB are served by size classes.
+	// Each class caches at most limit blocks(4MB of blocks by default), and malloc is used over the limit.
+	//
+
+	// Set limit of blocks of the class serving size, call it at startup(e.g. 200000 for sizeof(Ctcp) with 200k connections).
+	// Return false if size is not served by class.
+	bool __allocator_set_limit(const std::size_t size, const std::size_t number);
+
+	// Chunks reserved after this are mapped with mmap and madvise(MADV_HUGEPAGE), so blocks(e.g. Ctcp and buffers) share huge pages and TLB.
+	// Call it at startup(before pre-warm). Chunks fall back to aligned malloc when it fails, and return false if not supported.
+	bool __allocator_enable_huge_page(const bool bEnable);
+
+	// Carve blocks of the class serving size into cache(limit is raised for them), and pre-fault them.
+	// Return number of blocks reserved.
+	size_t __allocator_reserve(const std::size_t size, const std::size_t number);
+
+	// Statistics of a size class.
+	struct __allocator_class_stats
+	{
+		size_t m_size; // Block size.
+		size_t m_limit;
+		size_t m_carved; // Blocks carved from chunks.
+		size_t m_cached; // Free blocks in depot(blocks cached by threads are not included).
+		uint64_t m_hit; // Allocs served by cache of thread.
+		uint64_t m_miss; // Allocs not served by cache of thread(refill + carve + fallback).
+		uint64_t m_refill; // Batches taken from depot.
+		uint64_t m_carve; // Batches carved from chunks.
+		uint64_t m_fallback; // Allocs by malloc(over limit or insufficient memory).
+		uint64_t m_flush; // Batches given to depot.
+		uint64_t m_release; // Blocks freed to system(over limit).
+	};
+	// Fill at most number of classes, and return number of classes.
+	size_t __allocator_stats(__allocator_class_stats *stats, const std::size_t number);
+	// Bytes of chunks reserved from system.
+	size_t __allocator_chunk_bytes();
 
 	template<class T>
 	class CfastAllocator
@@ -0,0 +1,363 @@
+/* Copyright (c) 2018 Zhenyu Zhang. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace NETWORK_POOL
+{
+	//
+	// Open addressing hash map with robin hood probing and backward shift deletion.
+	// Entries live in one flat array(no node per entry), and subset of std::unordered_map interface is provided.
+	// Caution! Any insert or erase invalidates all iterators and references, and key must not be modified by iterator.
+	//
+	template <class K, class V, class Hash = std::hash<K>, class Equal = std::equal_to<K>>
+	class CflatMap
+	{
+	public:
+		typedef std::pair<K, V> value_type;
+
+	private:
+		struct __slot
+		{
+			uint32_t m_dist; // 0 means empty, otherwise 1 + distance from home slot.
+			uint32_t m_tag; // High bits of hash, compared before key.
+			typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type m_storage;
+
+			inline value_type& value()
+			{
+				return *(value_type *)&m_storage;
+			}
+		};
+
+		static const size_t s_minCapacity = 16;
+		static const size_t s_npos = ~(size_t)0;
+
+		__slot *m_slots;
+		size_t m_capacity; // Power of 2, or 0 before the first insert.
+		size_t m_size;
+
+		// Mix the hash, so identity hash(e.g. pointer) still spreads over the slots.
+		static inline uint64_t mix(const K& key)
+		{
+			uint64_t h = (uint64_t)Hash()(key);
+			h ^= h >> 33;
+			h *= 0xff51afd7ed558ccdull;
+			h ^= h >> 33;
+			return h;
+		}
+
+		inline size_t findIndex(const K& key, const uint64_t h) const
+		{
+			if (0 == m_size)
+				return s_npos;
+			const uint32_t tag = (uint32_t)(h >> 32);
+			const size_t mask = m_capacity - 1;
+			size_t pos = (size_t)h & mask;
+			for (uint32_t dist = 1; ; ++dist)
+			{
+				__slot& slot = m_slots[pos];
+				if (slot.m_dist < dist) // Empty or richer one, so not exists.
+					return s_npos;
+				if (slot.m_tag == tag && Equal()(slot.value().first, key))
+					return pos;
+				pos = (pos + 1) & mask;
+			}
+		}
+		inline size_t findIndex(const K& key) const
+		{
+			return 0 == m_size ? s_npos : findIndex(key, mix(key));
+		}
+
+		// Key must not exist and there must be room. Return the slot of the new entry.
+		inline size_t emplaceNew(const uint64_t h, value_type&& value)
+		{
+			const size_t mask = m_capacity - 1;
+			size_t pos = (size_t)h & mask;
+			uint32_t dist = 1;
+			// Stop at the first empty or richer slot.
+			while (m_slots[pos].m_dist >= dist)
+			{
+				pos = (pos + 1) & mask;
+				++dist;
+			}
+			// Take it from the rich, which is the same as shifting the rest of cluster forward by one.
+			size_t hole = pos;
+			while (m_slots[hole].m_dist != 0)
+				hole = (hole + 1) & mask;
+			while (hole != pos)
+			{
+				const size_t prev = (hole - 1) & mask;
+				new (&m_slots[hole].m_storage) value_type(std::move(m_slots[prev].value()));
+				m_slots[hole].m_dist = m_slots[prev].m_dist + 1;
+				m_slots[hole].m_tag = m_slots[prev].m_tag;
+				m_slots[prev].value().~value_type();
+				hole = prev;
+			}
+			new (&m_slots[pos].m_storage) value_type(std::move(value));
+			m_slots[pos].m_dist = dist;
+			m_slots[pos].m_tag = (uint32_t)(h >> 32);
+			return pos;
+		}
+
+		inline void eraseIndex(size_t pos)
+		{
+			const size_t mask = m_capacity - 1;
+			m_slots[pos].value().~value_type();
+			size_t next = (pos + 1) & mask;
+			while (m_slots[next].m_dist > 1)
+			{
+				new (&m_slots[pos].m_storage) value_type(std::move(m_slots[next].value()));
+				m_slots[pos].m_dist = m_slots[next].m_dist - 1;
+				m_slots[pos].m_tag = m_slots[next].m_tag;
+				m_slots[next].value().~value_type();
+				pos = next;
+				next = (next + 1) & mask;
+			}
+			m_slots[pos].m_dist = 0;
+			--m_size;
+		}
+
+		// May throw std::bad_alloc, and nothing changed then.
+		void rehash(const size_t capacity)
+		{
+			__slot *slots = new __slot[capacity];
+			for (size_t i = 0; i < capacity; ++i)
+				slots[i].m_dist = 0;
+			__slot *oldSlots = m_slots;
+			const size_t oldCapacity = m_capacity;
+			m_slots = slots;
+			m_capacity = capacity;
+			for (size_t i = 0; i < oldCapacity; ++i)
+			{
+				if (oldSlots[i].m_dist != 0)
+				{
+					value_type& value = oldSlots[i].value();
+					emplaceNew(mix(value.first), std::move(value));
+					value.~value_type();
+				}
+			}
+			delete[] oldSlots;
+		}
+
+		// Max load factor is 7/8.
+		inline void reserveForOneMore()
+		{
+			if (0 == m_capacity)
+				rehash(s_minCapacity);
+			else if (m_size + 1 > m_capacity - m_capacity / 8)
+				rehash(m_capacity * 2);
+		}
+
+		inline void destroyAll()
+		{
+			for (size_t i = 0; m_size > 0 && i < m_capacity; ++i)
+			{
+				if (m_slots[i].m_dist != 0)
+				{
+					m_slots[i].value().~value_type();
+					m_slots[i].m_dist = 0;
+					--m_size;
+				}
+			}
+		}
+
+	public:
+		template <class S, class T>
+		class __iterator
+		{
+		private:
+			S *m_slot;
+			S *m_end;
+
+			friend class CflatMap;
+
+			inline void skipEmpty()
+			{
+				while (m_slot != m_end && 0 == m_slot->m_dist)
+					++m_slot;
+			}
+
+		public:
+			__iterator(S *slot, S *end)
+				:m_slot(slot), m_end(end) {}
+			template <class S2, class T2>
+			__iterator(const __iterator<S2, T2>& another)
+				:m_slot(another.m_slot), m_end(another.m_end) {}
+
+			inline T& operator*() const
+			{
+				return m_slot->value();
+			}
+			inline T *operator->() const
+			{
+				return &m_slot->value();
+			}
+			inline __iterator& operator++()
+			{
+				++m_slot;
+				skipEmpty();
+				return *this;
+			}
+			inline bool operator==(const __iterator& another) const
+			{
+				return m_slot == another.m_slot;
+			}
+			inline bool operator!=(const __iterator& another) const
+			{
+				return m_slot != another.m_slot;
+			}
+
+			template <class S2, class T2>
+			friend class __iterator;
+		};
+		typedef __iterator<__slot, value_type> iterator;
+		typedef __iterator<__slot, const value_type> const_iterator;
+
+		CflatMap()
+			:m_slots(nullptr), m_capacity(0), m_size(0) {}
+		~CflatMap()
+		{
+			destroyAll();
+			delete[] m_slots;
+		}
+
+		// No copy, only move.
+		CflatMap(const CflatMap& another) = delete;
+		const CflatMap& operator=(const CflatMap& another) = delete;
+		CflatMap(CflatMap&& another)
+			:m_slots(another.m_slots), m_capacity(another.m_capacity), m_size(another.m_size)
+		{
+			another.m_slots = nullptr;
+			another.m_capacity = 0;
+			another.m_size = 0;
+		}
+		const CflatMap& operator=(CflatMap&& another)
+		{
+			if (this != &another)
+			{
+				destroyAll();
+				delete[] m_slots;
+				m_slots = another.m_slots;
+				m_capacity = another.m_capacity;
+				m_size = another.m_size;
+				another.m_slots = nullptr;
+				another.m_capacity = 0;
+				another.m_size = 0;
+			}
+			return *this;
+		}
+
+		inline iterator begin()
+		{
+			iterator it(m_slots, m_slots + m_capacity);
+			it.skipEmpty();
+			return it;
+		}
+		inline iterator end()
+		{
+			return iterator(m_slots + m_capacity, m_slots + m_capacity);
+		}
+		inline const_iterator begin() const
+		{
+			return const_cast<CflatMap *>(this)->begin();
+		}
+		inline const_iterator end() const
+		{
+			return const_cast<CflatMap *>(this)->end();
+		}
+
+		inline size_t size() const
+		{
+			return m_size;
+		}
+		inline bool empty() const
+		{
+			return 0 == m_size;
+		}
+
+		inline iterator find(const K& key)
+		{
+			const size_t pos = findIndex(key);
+			return s_npos == pos ? end() : iterator(m_slots + pos, m_slots + m_capacity);
+		}
+		inline const_iterator find(const K& key) const
+		{
+			return const_cast<CflatMap *>(this)->find(key);
+		}
+		inline size_t count(const K& key) const
+		{
+			return findIndex(key) != s_npos ? 1 : 0;
+		}
+
+		// May throw std::bad_alloc.
+		std::pair<iterator, bool> insert(value_type&& value)
+		{
+			const uint64_t h = mix(value.first);
+			size_t pos = findIndex(value.first, h);
+			if (pos != s_npos)
+				return std::make_pair(iterator(m_slots + pos, m_slots + m_capacity), false);
+			reserveForOneMore();
+			pos = emplaceNew(h, std::move(value));
+			++m_size;
+			return std::make_pair(iterator(m_slots + pos, m_slots + m_capacity), true);
+		}
+		std::pair<iterator, bool> insert(const value_type& value)
+		{
+			return insert(value_type(value));
+		}
+
+		inline void erase(const_iterator it)
+		{
+			eraseIndex(it.m_slot - m_slots);
+		}
+		inline size_t erase(const K& key)
+		{
+			const size_t pos = findIndex(key);
+			if (s_npos == pos)
+				return 0;
+			eraseIndex(pos);
+			return 1;
+		}
+
+		// Keep the slots.
+		inline void clear()
+		{
+			destroyAll();
+		}
+
+		// May throw std::bad_alloc.
+		void reserve(const size_t count)
+		{
+			size_t capacity = s_minCapacity;
+			while (capacity - capacity / 8 < count)
+				capacity *= 2;
+			if (capacity > m_capacity)
+				rehash(capacity);
+		}
+	};
+}
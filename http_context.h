@@ -70,6 +70,7 @@ namespace NETWORK_POOL
 					m_maxBufferSize = 0x1000;
 
 				m_buffer.resize(0x1000); // 4KB
+				m_buffer.getTrace()->_retag(m_buffer.getData(), tag_receive_buffer);
 				m_nowIndex = 0;
 
 				m_analysisIndex = 0;
@@ -152,10 +153,10 @@ namespace NETWORK_POOL
 			init();
 			if (m_buffer.getLength() - m_nowIndex < 0x800) // 2KB
 			{
-				if (m_buffer.getLength() * 2 > m_maxBufferSize)
-					m_buffer.resize(m_maxBufferSize, m_nowIndex);
-				else
-					m_buffer.resize(m_buffer.getLength() * 2, m_nowIndex);
+				// Buffer grows geometrically, so just ask for 2KB more and take all the capacity.
+				m_buffer.reserve(m_buffer.getLength() + 0x800 > m_maxBufferSize ? m_maxBufferSize : m_buffer.getLength() + 0x800, m_maxBufferSize);
+				m_buffer.resize(m_buffer.getMaxLength() > m_maxBufferSize ? m_maxBufferSize : m_buffer.getMaxLength());
+				m_buffer.getTrace()->_retag(m_buffer.getData(), tag_receive_buffer);
 			}
 			length = m_buffer.getLength() - m_nowIndex;
 			if (0 == length)
@@ -432,6 +433,13 @@ namespace NETWORK_POOL
 			char *ptr = (char *)m_buffer.getData();
 			memmove(ptr, ptr + m_analysisIndex, extra);
 			m_nowIndex = extra;
+			// Give back memory of large request, so idle connection only holds 4KB.
+			if (m_buffer.getLength() > 0x1000 && m_nowIndex <= 0x800)
+			{
+				m_buffer.resize(0x1000);
+				m_buffer.shrinkToFit();
+				m_buffer.getTrace()->_retag(m_buffer.getData(), tag_receive_buffer);
+			}
 
 			// Set others.
 			m_analysisIndex = 0;
@@ -33,8 +33,8 @@
 
 namespace NETWORK_POOL
 {
-	ChttpTask::ChttpTask(CmemoryTrace& memoryTrace, ChttpServer& server, const CnetworkNode& node)
-		:m_server(server), m_canceled(false), m_node(node), m_context(memoryTrace)
+	ChttpTask::ChttpTask(CmemoryTrace& memoryTrace, ChttpServer& server, const __connection_handle handle)
+		:m_server(server), m_canceled(false), m_handle(handle), m_context(memoryTrace)
 	{
 		m_server.addReferenceTask(this);
 	}
@@ -61,9 +61,9 @@ namespace NETWORK_POOL
 				"0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789"
 				"0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789"
 				"0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789");
-			pool->send(m_node, resp.c_str(), resp.length());
+			pool->send(m_handle, resp.c_str(), resp.length());
 			if (!m_context.isKeepAlive())
-				pool->close(m_node);
+				pool->close(m_handle);
 		}
 	}
 }
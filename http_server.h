@@ -50,16 +50,16 @@ namespace NETWORK_POOL
 		ChttpServer& m_server;
 		bool m_canceled;
 
-		CnetworkNode m_node;
+		__connection_handle m_handle;
 		ChttpContext m_context;
 
 	public:
-		ChttpTask(CmemoryTrace& memoryTrace, ChttpServer& server, const CnetworkNode& node);
+		ChttpTask(CmemoryTrace& memoryTrace, ChttpServer& server, const __connection_handle handle);
 		~ChttpTask();
 
-		const CnetworkNode& getNode() const
+		__connection_handle getHandle() const
 		{
-			return m_node;
+			return m_handle;
 		}
 		ChttpContext& getContext()
 		{
@@ -78,12 +78,10 @@ namespace NETWORK_POOL
 	{
 	private:
 		CmemoryTrace& m_memoryTrace;
-
-		std::unordered_map<CnetworkNode, ChttpContext, __network_hash> m_context;
 		CnetworkPool *m_pool;
 
 		std::mutex m_taskLock;
-		std::unordered_multimap<CnetworkNode, ChttpTask *, __network_hash> m_tasks;
+		std::unordered_multimap<__connection_handle, ChttpTask *> m_tasks;
 
 		CworkQueue m_workQueue;
 
@@ -103,12 +101,12 @@ namespace NETWORK_POOL
 		void addReferenceTask(ChttpTask *task)
 		{
 			std::lock_guard<std::mutex> guard(m_taskLock);
-			m_tasks.insert(std::make_pair(task->getNode(), task));
+			m_tasks.insert(std::make_pair(task->getHandle(), task));
 		}
 		void deleteReferenceTask(ChttpTask *task)
 		{
 			std::lock_guard<std::mutex> guard(m_taskLock);
-			auto range = m_tasks.equal_range(task->getNode());
+			auto range = m_tasks.equal_range(task->getHandle());
 			for (auto it = range.first; it != range.second; ++it)
 			{
 				if (it->second == task)
@@ -119,39 +117,51 @@ namespace NETWORK_POOL
 			}
 		}
 
-		void cancelTask(const CnetworkNode& node)
+		void cancelTask(const __connection_handle handle)
 		{
 			std::lock_guard<std::mutex> guard(m_taskLock);
-			auto range = m_tasks.equal_range(node);
+			auto range = m_tasks.equal_range(handle);
 			for (auto it = range.first; it != range.second; ++it)
 				it->second->cancel();
 		}
 
-		void allocateMemoryForMessage(const CnetworkNode& node, size_t suggestedSize, void *& buffer, size_t& lenght)
+		// Set tcp_context_size of pool to this, so context is allocated with connection.
+		static size_t getContextSize()
 		{
-			auto it = m_context.find(node);
-			if (it != m_context.end())
-				it->second.prepareBuffer(buffer, lenght);
+			return sizeof(ChttpContext);
 		}
-		void deallocateMemoryForMessage(const CnetworkNode& node, void *buffer, size_t lenght)
+
+		// Tcp only, and context lives in context of connection.
+		void allocateMemoryForMessage(const CnetworkNode& node, size_t suggestedSize, void *& buffer, size_t& lenght) {}
+		void deallocateMemoryForMessage(const CnetworkNode& node, void *buffer, size_t lenght) {}
+		void message(const CnetworkNode& node, const void *data, const size_t length) {}
+		void connectionStatus(const CnetworkNode& node, const bool bSuccess) {}
+
+		void allocateMemoryForMessage(const CnetworkNode& node, const __connection_handle handle, void *context, size_t suggestedSize, void *& buffer, size_t& lenght)
+		{
+			ChttpContext *ctx = (ChttpContext *)context;
+			if (ctx != nullptr)
+				ctx->prepareBuffer(buffer, lenght);
+		}
+		void deallocateMemoryForMessage(const CnetworkNode& node, const __connection_handle handle, void *context, void *buffer, size_t lenght)
 		{
 		}
 
-		void message(const CnetworkNode& node, const void *data, const size_t length)
+		void message(const CnetworkNode& node, const __connection_handle handle, void *context, const void *data, const size_t length)
 		{
-			auto it = m_context.find(node);
-			if (it != m_context.end())
+			ChttpContext *pCtx = (ChttpContext *)context;
+			if (pCtx != nullptr)
 			{
-				ChttpContext& ctx = it->second;
+				ChttpContext& ctx = *pCtx;
 				ctx.recvPush(length);
 			_again:
 				if (ctx.analysis())
 				{
 					if (ctx.isGood() && m_pool != nullptr)
 					{
-						ChttpTask *task = m_memoryTrace._new_no_throw<ChttpTask>(m_memoryTrace, *this, node);
+						ChttpTask *task = m_memoryTrace._new_no_throw<ChttpTask>(m_memoryTrace, *this, handle);
 						if (nullptr == task)
-							m_pool->close(node);
+							m_pool->close(handle);
 						else
 						{
 							ctx.reinitForNext(task->getContext());
@@ -164,7 +174,7 @@ namespace NETWORK_POOL
 						}
 					}
 					else if (m_pool != nullptr)
-						m_pool->close(node);
+						m_pool->close(handle);
 				}
 			}
 		}
@@ -178,15 +188,41 @@ namespace NETWORK_POOL
 		{
 			NP_FPRINTF((stdout, "bind: [%s]:%u %s.\n", node.getSockaddr().getIp().c_str(), node.getSockaddr().getPort(), bSuccess ? "success" : "fail"));
 		}
-		void connectionStatus(const CnetworkNode& node, const bool bSuccess)
+		void connectionStatus(const CnetworkNode& node, const __connection_handle handle, void *& context, const bool bSuccess)
 		{
 			NP_FPRINTF((stdout, "connection: from-[%s]:%u %s.\n", node.getSockaddr().getIp().c_str(), node.getSockaddr().getPort(), bSuccess ? "success" : "fail"));
+			if (0 == handle)
+			{
+				// No handle, just close.
+				if (bSuccess && m_pool != nullptr)
+					m_pool->close(node);
+				return;
+			}
+			const bool bInline = m_pool != nullptr && m_pool->getSettings().tcp_context_size >= sizeof(ChttpContext);
 			if (bSuccess)
-				m_context.insert(std::make_pair(node, ChttpContext(m_memoryTrace)));
+			{
+				// Construct in storage of connection if large enough.
+				if (bInline)
+					context = new (context)ChttpContext(m_memoryTrace);
+				else
+				{
+					context = m_memoryTrace._new_no_throw<ChttpContext, tag_context>(m_memoryTrace);
+					if (nullptr == context && m_pool != nullptr)
+						m_pool->close(handle);
+				}
+			}
 			else
 			{
-				m_context.erase(node);
-				cancelTask(node);
+				ChttpContext *ctx = (ChttpContext *)context;
+				if (bInline)
+				{
+					if (ctx != nullptr)
+						ctx->~ChttpContext();
+				}
+				else
+					m_memoryTrace._delete_set_nullptr(ctx);
+				context = nullptr;
+				cancelTask(handle);
 			}
 		}
 	};
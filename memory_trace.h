@@ -33,14 +33,176 @@
 
 namespace NETWORK_POOL
 {
+	// Tag of allocation, for statistics of where memory goes.
+	enum __memory_tag
+	{
+		tag_other = 0,
+		tag_connection, // Tcp, udp and async handles(with tcp context), and connect/shutdown requests.
+		tag_receive_buffer, // Receive buffers of connections.
+		tag_send_payload, // Data of sends in network pool(including shared buffers).
+		tag_waiting, // Data of sends waiting for connection complete.
+		tag_write_request, // Tcp write and udp send requests.
+		tag_pending_request, // Requests exchanged between threads and loops.
+		tag_context, // Contexts of http and peer connections(when not in tcp context).
+		tag_buffer, // Cbuffer not given to network pool.
+		tag_number
+	};
+
+	struct __memory_tag_stats
+	{
+		uint64_t m_size;
+		uint64_t m_peakSize;
+		uint64_t m_count;
+		uint64_t m_peakCount;
+	};
+	struct __memory_snapshot
+	{
+		__memory_tag_stats m_total;
+		__memory_tag_stats m_tags[tag_number];
+	};
+
+	//
+	// Counters are sharded by thread, so threads allocating at the same time don't bounce one cache line.
+	// The first threads own a shard each(updated without atomic read-modify-write), and later threads share the last one.
+	// Usage and count are summed from shards when read, so they may be a little stale under concurrent allocation.
+	// Each shard flushes its counters to the global ones when they change over granularity, and peaks are kept there.
+	// So peaks are cheap and accurate within granularity per thread.
+	//
 	class CmemoryTrace
 	{
 	private:
-		std::atomic<int64_t> m_size;
-		std::atomic<int32_t> m_count;
+		static const size_t s_shardNumber = 16; // Owned by threads, and one more shared.
+		static const size_t s_cacheLineSize = 64;
+		static const int64_t s_sizeGranularity = 65536;
+		static const int64_t s_countGranularity = 64;
+		// Tag is kept in the high bits of size before the allocation.
+		static const unsigned int s_tagBits = 4;
+		static const unsigned int s_tagShift = sizeof(size_t) * 8 - s_tagBits;
+		static const size_t s_sizeMask = ((size_t)1 << s_tagShift) - 1;
+		static const size_t s_total = tag_number; // Index of total in counters.
+
+		// Counters not flushed yet.
+		struct alignas(s_cacheLineSize) __shard
+		{
+			std::atomic<int64_t> m_size[tag_number + 1];
+			std::atomic<int64_t> m_count[tag_number + 1];
+		};
+		__shard m_shards[s_shardNumber + 1];
+		struct __counter
+		{
+			std::atomic<int64_t> m_flushed;
+			std::atomic<int64_t> m_peak;
+		};
+		__counter m_sizes[tag_number + 1];
+		__counter m_counts[tag_number + 1];
+		// Memory budget in bytes, 0 means no limit.
+		std::atomic<uint64_t> m_softBudget;
+		std::atomic<uint64_t> m_hardBudget;
+
+		// Index of shard of thread(same for all traces), and index of shared one when all are taken.
+		static inline size_t getShardIndex()
+		{
+			static std::atomic<size_t> s_nextShard(0);
+			static thread_local size_t s_shardIndex = ~(size_t)0; // Constant initialized, so no guard on access.
+			if (~(size_t)0 == s_shardIndex)
+			{
+				s_shardIndex = s_nextShard.fetch_add(1, std::memory_order_relaxed);
+				if (s_shardIndex > s_shardNumber)
+					s_shardIndex = s_shardNumber;
+			}
+			return s_shardIndex;
+		}
+
+		static inline void add(std::atomic<int64_t>& pending, const int64_t delta, const bool bOwned, const int64_t granularity, __counter& counter)
+		{
+			int64_t value;
+			if (bOwned)
+			{
+				value = pending.load(std::memory_order_relaxed) + delta;
+				pending.store(value, std::memory_order_relaxed);
+			}
+			else
+				value = pending.fetch_add(delta, std::memory_order_relaxed) + delta;
+			if (value < granularity && value > -granularity)
+				return;
+			int64_t flush;
+			if (bOwned)
+			{
+				flush = value;
+				pending.store(0, std::memory_order_relaxed);
+			}
+			else
+				flush = pending.exchange(0, std::memory_order_relaxed);
+			const int64_t flushed = counter.m_flushed.fetch_add(flush, std::memory_order_relaxed) + flush;
+			int64_t peak = counter.m_peak.load(std::memory_order_relaxed);
+			while (flushed > peak && !counter.m_peak.compare_exchange_weak(peak, flushed, std::memory_order_relaxed));
+		}
+
+		inline void add(const size_t tag, const int64_t size, const int64_t count)
+		{
+			const size_t index = getShardIndex();
+			const bool bOwned = index < s_shardNumber;
+			__shard& shard = m_shards[index];
+			add(shard.m_size[tag], size, bOwned, s_sizeGranularity, m_sizes[tag]);
+			add(shard.m_count[tag], count, bOwned, s_countGranularity, m_counts[tag]);
+			if (tag != s_total)
+			{
+				add(shard.m_size[s_total], size, bOwned, s_sizeGranularity, m_sizes[s_total]);
+				add(shard.m_count[s_total], count, bOwned, s_countGranularity, m_counts[s_total]);
+			}
+		}
+
+		typedef std::atomic<int64_t> __shard_counters[tag_number + 1];
+		inline int64_t sum(__shard_counters __shard::*counters, const __counter *flushed, const size_t tag) const
+		{
+			int64_t value = flushed[tag].m_flushed.load(std::memory_order_relaxed);
+			for (auto& shard : m_shards)
+				value += (shard.*counters)[tag].load(std::memory_order_relaxed);
+			return value;
+		}
+		inline void getStats(const size_t tag, __memory_tag_stats& stats) const
+		{
+			const int64_t size = sum(&__shard::m_size, m_sizes, tag);
+			const int64_t count = sum(&__shard::m_count, m_counts, tag);
+			const int64_t peakSize = m_sizes[tag].m_peak.load(std::memory_order_relaxed);
+			const int64_t peakCount = m_counts[tag].m_peak.load(std::memory_order_relaxed);
+			stats.m_size = (uint64_t)size;
+			stats.m_peakSize = (uint64_t)(peakSize > size ? peakSize : size);
+			stats.m_count = (uint64_t)count;
+			stats.m_peakCount = (uint64_t)(peakCount > count ? peakCount : count);
+		}
+
+		inline size_t checkSize(const size_t sz) const
+		{
+			size_t allocSize = sizeof(size_t) + sz;
+			if (allocSize < sz || allocSize > s_sizeMask) // In case of overflow.
+			{
+				NP_FPRINTF((stderr, "malloc size overflow.\n"));
+				std::terminate();
+			}
+			return allocSize;
+		}
 
 	public:
-		CmemoryTrace() :m_size(0), m_count(0) {}
+		CmemoryTrace()
+			:m_softBudget(0), m_hardBudget(0)
+		{
+			for (auto& shard : m_shards)
+			{
+				for (size_t i = 0; i <= tag_number; ++i)
+				{
+					shard.m_size[i].store(0, std::memory_order_relaxed);
+					shard.m_count[i].store(0, std::memory_order_relaxed);
+				}
+			}
+			for (size_t i = 0; i <= tag_number; ++i)
+			{
+				m_sizes[i].m_flushed.store(0, std::memory_order_relaxed);
+				m_sizes[i].m_peak.store(0, std::memory_order_relaxed);
+				m_counts[i].m_flushed.store(0, std::memory_order_relaxed);
+				m_counts[i].m_peak.store(0, std::memory_order_relaxed);
+			}
+		}
 
 		// No copy, no move.
 		CmemoryTrace(const CmemoryTrace& another) = delete;
@@ -50,51 +212,80 @@ namespace NETWORK_POOL
 
 		inline uint32_t getObjectCount() const
 		{
-			return m_count;
+			return (uint32_t)sum(&__shard::m_count, m_counts, s_total);
 		}
 		inline uint64_t getMemoryUsage() const
 		{
-			return m_size;
+			return (uint64_t)sum(&__shard::m_size, m_sizes, s_total);
+		}
+
+		// Current and peak of total and each tag.
+		inline void getSnapshot(__memory_snapshot& snapshot) const
+		{
+			getStats(s_total, snapshot.m_total);
+			for (size_t i = 0; i < tag_number; ++i)
+				getStats(i, snapshot.m_tags[i]);
+		}
+		static inline const char *getTagName(const __memory_tag tag)
+		{
+			static const char *s_names[tag_number] =
+			{
+				"other", "connection", "receive buffer", "send payload", "waiting", "write request", "pending request", "context", "buffer"
+			};
+			return tag < tag_number ? s_names[tag] : "unknown";
+		}
+
+		// Network pool consults the budget:
+		// Above soft budget, it stops reading from tcp connections and rejects new connections.
+		// Above hard budget, it drops new sends(notified by drop of callback, in the thread calling send).
+		// And it resumes automatically when usage falls below.
+		// Set 0 means no limit.
+		inline void setBudget(const uint64_t softBudget, const uint64_t hardBudget)
+		{
+			m_softBudget.store(softBudget, std::memory_order_relaxed);
+			m_hardBudget.store(hardBudget, std::memory_order_relaxed);
+		}
+		inline bool hasSoftBudget() const
+		{
+			return m_softBudget.load(std::memory_order_relaxed) != 0;
+		}
+		inline bool isOverSoftBudget() const
+		{
+			const uint64_t budget = m_softBudget.load(std::memory_order_relaxed);
+			return budget != 0 && getMemoryUsage() >= budget;
+		}
+		inline bool isOverHardBudget() const
+		{
+			const uint64_t budget = m_hardBudget.load(std::memory_order_relaxed);
+			return budget != 0 && getMemoryUsage() >= budget;
 		}
 
 		//
 		// Following function(s) are internal used only.
 		//
 
-		inline void *_malloc_throw(const size_t sz)
+		inline void *_malloc_throw(const size_t sz, const __memory_tag tag = tag_other)
 		{
-			size_t allocSize = sizeof(size_t) + sz;
-			if (allocSize < sz) // In case of overflow.
-			{
-				NP_FPRINTF((stderr, "malloc_throw size overflow.\n"));
-				std::terminate();
-			}
+			size_t allocSize = checkSize(sz);
 			void *ptr = __alloc(allocSize);
 			if (nullptr == ptr)
 				throw std::bad_alloc();
-			*(size_t *)ptr = allocSize;
-			m_size += allocSize;
-			++m_count;
+			*(size_t *)ptr = allocSize | ((size_t)tag << s_tagShift);
+			add(tag, (int64_t)allocSize, 1);
 		#if NP_DBG
 			memset((size_t *)ptr + 1, -1, sz);
 		#endif
 			return (size_t *)ptr + 1;
 		}
 
-		inline void *_malloc_no_throw(const size_t sz)
+		inline void *_malloc_no_throw(const size_t sz, const __memory_tag tag = tag_other)
 		{
-			size_t allocSize = sizeof(size_t) + sz;
-			if (allocSize < sz) // In case of overflow.
-			{
-				NP_FPRINTF((stderr, "malloc_no_throw size overflow.\n"));
-				std::terminate();
-			}
+			size_t allocSize = checkSize(sz);
 			void *ptr = __alloc(allocSize);
 			if (nullptr == ptr)
 				return nullptr;
-			*(size_t *)ptr = allocSize;
-			m_size += allocSize;
-			++m_count;
+			*(size_t *)ptr = allocSize | ((size_t)tag << s_tagShift);
+			add(tag, (int64_t)allocSize, 1);
 		#if NP_DBG
 			memset((size_t *)ptr + 1, -1, sz);
 		#endif
@@ -107,9 +298,9 @@ namespace NETWORK_POOL
 			if (nullptr == ptr)
 				return;
 			void *org = (size_t *)ptr - 1;
-			size_t allocSize = *(size_t *)org;
-			m_size -= allocSize;
-			--m_count;
+			const size_t header = *(size_t *)org;
+			size_t allocSize = header & s_sizeMask;
+			add(header >> s_tagShift, -(int64_t)allocSize, -1);
 		#if NP_DBG
 			memset(org, -1, allocSize);
 		#endif
@@ -117,10 +308,69 @@ namespace NETWORK_POOL
 			ptr = nullptr;
 		}
 
-		template<class T, class... Args>
+		// Usable size when sz is allocated(rounded up to block of allocator).
+		static inline size_t _usable_size(const size_t sz)
+		{
+			const size_t allocSize = sizeof(size_t) + sz;
+			if (allocSize < sz) // Overflow, and checked when allocate.
+				return sz;
+			return __alloc_size(allocSize) - sizeof(size_t);
+		}
+
+		// Keep the tag and content, and ptr is still valid if failed.
+		inline void *_realloc_no_throw(void *ptr, const size_t sz)
+		{
+			if (nullptr == ptr)
+				return _malloc_no_throw(sz);
+			size_t allocSize = checkSize(sz);
+			void *org = (size_t *)ptr - 1;
+			const size_t header = *(size_t *)org;
+			const size_t oldSize = header & s_sizeMask;
+			const size_t tag = header >> s_tagShift;
+			void *newOrg = __realloc(org, oldSize, allocSize);
+			if (nullptr == newOrg)
+				return nullptr;
+			*(size_t *)newOrg = allocSize | (tag << s_tagShift);
+			add(tag, (int64_t)allocSize - (int64_t)oldSize, 0);
+		#if NP_DBG
+			if (allocSize > oldSize)
+				memset((char *)newOrg + oldSize, -1, allocSize - oldSize);
+		#endif
+			return (size_t *)newOrg + 1;
+		}
+
+		inline void *_realloc_throw(void *ptr, const size_t sz)
+		{
+			void *newPtr = _realloc_no_throw(ptr, sz);
+			if (nullptr == newPtr)
+				throw std::bad_alloc();
+			return newPtr;
+		}
+
+		// Move allocation to another tag.
+		inline void _retag(void *ptr, const __memory_tag tag)
+		{
+			if (nullptr == ptr)
+				return;
+			size_t& header = *((size_t *)ptr - 1);
+			const size_t oldTag = header >> s_tagShift;
+			if (oldTag == (size_t)tag)
+				return;
+			const size_t allocSize = header & s_sizeMask;
+			header = allocSize | ((size_t)tag << s_tagShift);
+			const size_t index = getShardIndex();
+			const bool bOwned = index < s_shardNumber;
+			__shard& shard = m_shards[index];
+			add(shard.m_size[oldTag], -(int64_t)allocSize, bOwned, s_sizeGranularity, m_sizes[oldTag]);
+			add(shard.m_count[oldTag], -1, bOwned, s_countGranularity, m_counts[oldTag]);
+			add(shard.m_size[tag], (int64_t)allocSize, bOwned, s_sizeGranularity, m_sizes[tag]);
+			add(shard.m_count[tag], 1, bOwned, s_countGranularity, m_counts[tag]);
+		}
+
+		template<class T, __memory_tag tag = tag_other, class... Args>
 		inline T *_new_throw(Args&&... args)
 		{
-			T *ptr = (T *)_malloc_throw(sizeof(T));
+			T *ptr = (T *)_malloc_throw(sizeof(T), tag);
 			try
 			{
 				return new (ptr)T(std::forward<Args>(args)...);
@@ -132,10 +382,10 @@ namespace NETWORK_POOL
 			}
 		}
 
-		template<class T, class... Args>
+		template<class T, __memory_tag tag = tag_other, class... Args>
 		inline T *_new_no_throw(Args&&... args)
 		{
-			T *ptr = (T *)_malloc_no_throw(sizeof(T));
+			T *ptr = (T *)_malloc_no_throw(sizeof(T), tag);
 			if (nullptr == ptr)
 				return nullptr;
 			try
@@ -0,0 +1,96 @@
+/* Copyright (c) 2018 Zhenyu Zhang. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+
+namespace NETWORK_POOL
+{
+	struct __mpsc_node
+	{
+		std::atomic<__mpsc_node *> m_next;
+	};
+
+	//
+	// Intrusive lock-free multi-producer single-consumer queue.
+	// Push is wait-free and can be called by any thread, pop must be called by the only consumer.
+	// Nodes are FIFO, so order of nodes pushed by the same producer is kept.
+	//
+	class CmpscQueue
+	{
+	private:
+		std::atomic<__mpsc_node *> m_head; // Producers push here.
+		__mpsc_node *m_tail; // Consumer pops here.
+		__mpsc_node m_stub;
+
+	public:
+		CmpscQueue()
+			:m_head(&m_stub), m_tail(&m_stub)
+		{
+			m_stub.m_next.store(nullptr, std::memory_order_relaxed);
+		}
+
+		// No copy, no move.
+		CmpscQueue(const CmpscQueue& another) = delete;
+		CmpscQueue(CmpscQueue&& another) = delete;
+		const CmpscQueue& operator=(const CmpscQueue& another) = delete;
+		const CmpscQueue& operator=(CmpscQueue&& another) = delete;
+
+		inline void push(__mpsc_node *node)
+		{
+			node->m_next.store(nullptr, std::memory_order_relaxed);
+			__mpsc_node *prev = m_head.exchange(node, std::memory_order_acq_rel);
+			prev->m_next.store(node, std::memory_order_release);
+		}
+
+		// Return nullptr if empty or a producer is in the middle of push.
+		// The producer will wake up the consumer after the push, so nothing is lost.
+		inline __mpsc_node *pop()
+		{
+			__mpsc_node *tail = m_tail;
+			__mpsc_node *next = tail->m_next.load(std::memory_order_acquire);
+			if (&m_stub == tail)
+			{
+				if (nullptr == next)
+					return nullptr;
+				m_tail = next;
+				tail = next;
+				next = next->m_next.load(std::memory_order_acquire);
+			}
+			if (next != nullptr)
+			{
+				m_tail = next;
+				return tail;
+			}
+			if (tail != m_head.load(std::memory_order_acquire))
+				return nullptr;
+			push(&m_stub);
+			next = tail->m_next.load(std::memory_order_acquire);
+			if (next != nullptr)
+			{
+				m_tail = next;
+				return tail;
+			}
+			return nullptr;
+		}
+	};
+}
@@ -22,6 +22,7 @@
 #pragma once
 
 #include "network_node.h"
+#include "buffer.h"
 
 namespace NETWORK_POOL
 {
@@ -43,12 +44,47 @@ namespace NETWORK_POOL
 		// Note: Drop before connection down notification means failed to send(maybe other reasons),
 		//       and drop after connection down notification means failed by the down of the connection.
 		virtual void drop(const CnetworkNode& node, const void *data, const size_t length) = 0;
+		// Same as drop, but the ownership of data is given back.
+		// Move data out to keep it(e.g. send again without copy), or it will be freed after return.
+		virtual void dropBuffer(const CnetworkNode& node, Cbuffer& data)
+		{
+			drop(node, data.getData(), data.getLength());
+		}
 
 		// Local bind notification.
 		virtual void bindStatus(const CnetworkNode& node, const bool bSuccess) = 0;
 		// Remote connection notification.
 		// Note: No connection down notification if you send a message without auto connect when there is no connection established.
 		virtual void connectionStatus(const CnetworkNode& node, const bool bSuccess) = 0;
+		// Tcp connection which was over the high watermark of write queue is drained to the low watermark.
+		virtual void writable(const CnetworkNode& node) {}
+
+		// Tcp notifications with handle and context of connection.
+		// Handle can be used to send and close without lookup by node, and it's 0 when connection is not established(e.g. connect fail).
+		// Context is set in connection success notification, and it points to tcp_context_size bytes allocated with the connection
+		// (or nullptr if tcp_context_size is 0), so construct the context there or point it to your own one.
+		// Context given to connection down notification must be destroyed(if not nullptr), and it's nullptr after that.
+		// They call the notifications without handle by default.
+		virtual void allocateMemoryForMessage(const CnetworkNode& node, const __connection_handle handle, void *context, size_t suggestedSize, void *& buffer, size_t& lenght)
+		{
+			allocateMemoryForMessage(node, suggestedSize, buffer, lenght);
+		}
+		virtual void deallocateMemoryForMessage(const CnetworkNode& node, const __connection_handle handle, void *context, void *buffer, size_t lenght)
+		{
+			deallocateMemoryForMessage(node, buffer, lenght);
+		}
+		virtual void message(const CnetworkNode& node, const __connection_handle handle, void *context, const void *data, const size_t length)
+		{
+			message(node, data, length);
+		}
+		virtual void connectionStatus(const CnetworkNode& node, const __connection_handle handle, void *& context, const bool bSuccess)
+		{
+			connectionStatus(node, bSuccess);
+		}
+		virtual void writable(const CnetworkNode& node, const __connection_handle handle, void *context)
+		{
+			writable(node);
+		}
 
 		// Error notifications of binded port.
 		// Note: Error on tcp connection will cause connection down.
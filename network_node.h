@@ -21,7 +21,10 @@
 
 #pragma once
 
+#include <chrono>
+#include <cstdint>
 #include <cstring>
+#include <random>
 #include <string>
 #include <utility>
 
@@ -41,6 +44,53 @@ namespace NETWORK_POOL
 			sockaddr_in6 sockaddr6;
 		} m_sockaddr;
 
+		// Finalizer of murmur3, all bits of input affect all bits of output.
+		static inline uint64_t mix(uint64_t h)
+		{
+			h ^= h >> 33;
+			h *= 0xff51afd7ed558ccdull;
+			h ^= h >> 33;
+			h *= 0xc4ceb9fe1a85ec53ull;
+			h ^= h >> 33;
+			return h;
+		}
+
+		// 64x64->128 multiply folded by xor of halves(mum of wyhash).
+		static inline uint64_t mum(const uint64_t a, const uint64_t b)
+		{
+		#ifdef __SIZEOF_INT128__
+			const unsigned __int128 r = (unsigned __int128)a * b;
+			return (uint64_t)r ^ (uint64_t)(r >> 64);
+		#else
+			const uint64_t aLo = (uint32_t)a, aHi = a >> 32, bLo = (uint32_t)b, bHi = b >> 32;
+			const uint64_t ll = aLo * bLo, lh = aLo * bHi, hl = aHi * bLo, hh = aHi * bHi;
+			const uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+			return ((mid << 32) | (uint32_t)ll) ^ (hh + (lh >> 32) + (hl >> 32) + (mid >> 32));
+		#endif
+		}
+
+		static uint64_t makeSeed()
+		{
+			uint64_t seed = (uint64_t)std::chrono::high_resolution_clock::now().time_since_epoch().count();
+			try
+			{
+				std::random_device device;
+				seed ^= ((uint64_t)device() << 32) | device();
+			}
+			catch (...)
+			{
+				// No random device, and time is enough.
+			}
+			return mix(seed);
+		}
+		static inline uint64_t getSeed()
+		{
+			static const uint64_t seed = makeSeed();
+			return seed;
+		}
+
+		friend class CnetworkNode;
+
 	public:
 		inline void init()
 		{
@@ -270,23 +320,26 @@ namespace NETWORK_POOL
 			return (const sockaddr *)&m_sockaddr;
 		}
 
+		// Mix of port and address, seeded per process against hash flooding.
+		// Invalid address keeps the hash unmixed, so it's the same as default constructed one.
 		inline size_t getHash(size_t hash) const
 		{
 			switch (m_sockaddr.family)
 			{
 			case AF_INET:
-				hash += *(uint32_t *)&m_sockaddr.sockaddr4.sin_addr;
-				hash = (hash << 16) | m_sockaddr.sockaddr4.sin_port;
-				break;
+			{
+				uint64_t key = ((uint64_t)*(uint32_t *)&m_sockaddr.sockaddr4.sin_addr << 16) | m_sockaddr.sockaddr4.sin_port;
+				return (size_t)mix(mix(getSeed() ^ hash) ^ key);
+			}
+			break;
 
 			case AF_INET6:
 			{
-				uint32_t *addr = (uint32_t *)&m_sockaddr.sockaddr6.sin6_addr;
-				hash += addr[0];
-				hash = hash * 0xFFFF + addr[1];
-				hash = hash * 0xFFFF + addr[2];
-				hash = hash * 0xFFFF + addr[3];
-				hash = (hash << 16) | m_sockaddr.sockaddr6.sin6_port;
+				uint64_t addr[2];
+				memcpy(addr, &m_sockaddr.sockaddr6.sin6_addr, sizeof(addr));
+				uint64_t h = mix(mix(getSeed() ^ hash) ^ addr[0]);
+				h = mix(h ^ addr[1]);
+				return (size_t)mix(h ^ (((uint64_t)m_sockaddr.sockaddr6.sin6_scope_id << 16) | m_sockaddr.sockaddr6.sin6_port));
 			}
 			break;
 
@@ -345,6 +398,10 @@ namespace NETWORK_POOL
 		}
 	};
 
+	//
+	// Packed key of 24 bytes(address, scope id, port, family and protocol), so equality is 3 compares of 64 bits
+	// and hash is computed without branch. It's trivially copyable, and converted to Csockaddr when needed.
+	//
 	class CnetworkNode : public CfastAllocator<CnetworkNode>
 	{
 	public:
@@ -355,54 +412,84 @@ namespace NETWORK_POOL
 		};
 
 	private:
-		protocol_type m_protocol;
-		Csockaddr m_sockaddr;
+		uint64_t m_addr[2]; // In network order, IPv4 uses the first 4 bytes and the rest are 0.
+		// Following 8 bytes are compared and hashed as one.
+		uint32_t m_scopeId; // IPv6 only.
+		uint16_t m_port; // In network order.
+		uint8_t m_family; // 0 if invalid.
+		uint8_t m_protocol;
 
-		size_t m_hash;
+		inline uint64_t getTail() const
+		{
+			uint64_t tail;
+			memcpy(&tail, &m_scopeId, sizeof(tail));
+			return tail;
+		}
 
-		inline void rehash()
+		inline void initAddress()
 		{
-			m_hash = m_sockaddr.getHash(m_protocol * 31);
+			m_addr[0] = m_addr[1] = 0;
+			m_scopeId = 0;
+			m_port = 0;
+			m_family = 0;
+		}
+
+		inline bool initAddress(const sockaddr *raw, const size_t size)
+		{
+			initAddress();
+			if (size < 8) // family+port+ipv4
+				return false;
+			switch (raw->sa_family)
+			{
+			case AF_INET:
+			{ // Size checked before.
+				const sockaddr_in *in4 = (const sockaddr_in *)raw;
+				memcpy(m_addr, &in4->sin_addr, 4);
+				m_port = in4->sin_port;
+				m_family = AF_INET;
+			}
+			break;
+
+			case AF_INET6:
+			{
+				if (size < sizeof(sockaddr_in6))
+					return false;
+				const sockaddr_in6 *in6 = (const sockaddr_in6 *)raw;
+				memcpy(m_addr, &in6->sin6_addr, 16);
+				m_scopeId = in6->sin6_scope_id;
+				m_port = in6->sin6_port;
+				m_family = AF_INET6;
+			}
+			break;
+
+			default:
+				return false;
+			}
+			return true;
 		}
 
 	public:
 		CnetworkNode()
-			:m_protocol(protocol_tcp), m_hash(0) {} // All zero and hash is 0.
+			:m_protocol(protocol_tcp) { initAddress(); }
 		CnetworkNode(const protocol_type protocol, const sockaddr *raw, const size_t size)
-			:m_protocol(protocol), m_sockaddr(raw, size) { rehash(); }
+			:m_protocol((uint8_t)protocol) { initAddress(raw, size); }
 		CnetworkNode(const protocol_type protocol, const char *ip, const unsigned short port)
-			:m_protocol(protocol), m_sockaddr(ip, port) { rehash(); }
-		CnetworkNode(const CnetworkNode& another)
-			:m_protocol(another.m_protocol), m_sockaddr(another.m_sockaddr), m_hash(another.m_hash) {}
-		CnetworkNode(CnetworkNode&& another) // Move is copy, and another.m_hash will not change.
-			:m_protocol(another.m_protocol), m_sockaddr(std::move(another.m_sockaddr)), m_hash(another.m_hash) {}
-
-		const CnetworkNode& operator=(const CnetworkNode& another)
-		{
-			m_protocol = another.m_protocol;
-			m_sockaddr = another.m_sockaddr;
-			m_hash = another.m_hash;
-			return *this;
-		}
-		const CnetworkNode& operator=(CnetworkNode&& another) // Move is copy, and another.m_hash will not change.
-		{
-			m_protocol = another.m_protocol;
-			m_sockaddr = another.m_sockaddr;
-			m_hash = another.m_hash;
-			return *this;
-		}
+			:m_protocol((uint8_t)protocol) { set(protocol, ip, port); }
+		CnetworkNode(const protocol_type protocol, const Csockaddr& addr)
+			:m_protocol((uint8_t)protocol) { initAddress(addr.getSockaddr(), sizeof(sockaddr_in6)); }
 
 		bool operator<(const CnetworkNode& another) const
 		{
-			if (m_hash != another.m_hash)
-				return m_hash < another.m_hash;
-			if (m_protocol != another.m_protocol)
-				return m_protocol < another.m_protocol;
-			return m_sockaddr < another.m_sockaddr;
+			const uint64_t tail0 = getTail(), tail1 = another.getTail();
+			if (tail0 != tail1)
+				return tail0 < tail1;
+			if (m_addr[0] != another.m_addr[0])
+				return m_addr[0] < another.m_addr[0];
+			return m_addr[1] < another.m_addr[1];
 		}
 		bool operator==(const CnetworkNode& another) const
 		{
-			return m_hash == another.m_hash && m_protocol == another.m_protocol && m_sockaddr == another.m_sockaddr;
+			return 0 == ((m_addr[0] ^ another.m_addr[0]) | (m_addr[1] ^ another.m_addr[1]) | (getTail() ^ another.getTail()));
 		}
 		bool operator!=(const CnetworkNode& another) const
 		{
@@ -411,31 +498,65 @@ namespace NETWORK_POOL
 
 		inline bool set(const protocol_type protocol, const sockaddr *raw, const size_t size)
 		{
-			m_protocol = protocol;
-			bool bRet = m_sockaddr.init(raw, size);
-			rehash();
-			return bRet;
+			m_protocol = (uint8_t)protocol;
+			return initAddress(raw, size);
 		}
 		inline bool set(const protocol_type protocol, const char *ip, const unsigned short port)
 		{
-			m_protocol = protocol;
-			bool bRet = m_sockaddr.init(ip, port);
-			rehash();
-			return bRet;
+			m_protocol = (uint8_t)protocol;
+			Csockaddr addr;
+			if (!addr.init(ip, port))
+			{
+				initAddress();
+				return false;
+			}
+			return initAddress(addr.getSockaddr(), sizeof(sockaddr_in6));
 		}
 
 		inline protocol_type getProtocol() const
 		{
-			return m_protocol;
+			return (protocol_type)m_protocol;
 		}
-		inline const Csockaddr& getSockaddr() const
+		// Caution! It's a temporary, so don't keep the pointer of sockaddr in it.
+		inline Csockaddr getSockaddr() const
 		{
-			return m_sockaddr;
+			switch (m_family)
+			{
+			case AF_INET:
+			{
+				sockaddr_in in4;
+				memset(&in4, 0, sizeof(in4));
+				in4.sin_family = AF_INET;
+				in4.sin_port = m_port;
+				memcpy(&in4.sin_addr, m_addr, 4);
+				return Csockaddr((const sockaddr *)&in4, sizeof(in4));
+			}
+
+			case AF_INET6:
+			{
+				sockaddr_in6 in6;
+				memset(&in6, 0, sizeof(in6));
+				in6.sin6_family = AF_INET6;
+				in6.sin6_port = m_port;
+				memcpy(&in6.sin6_addr, m_addr, 16);
+				in6.sin6_scope_id = m_scopeId;
+				return Csockaddr((const sockaddr *)&in6, sizeof(in6));
+			}
+
+			default:
+				return Csockaddr();
+			}
+		}
+		inline bool valid() const
+		{
+			return AF_INET == m_family || AF_INET6 == m_family;
 		}
 
+		// Seeded per process against hash flooding.
 		inline size_t getHash() const
 		{
-			return m_hash;
+			const uint64_t h = Csockaddr::mum(m_addr[0] ^ Csockaddr::getSeed(), m_addr[1] ^ 0xa0761d6478bd642full);
+			return (size_t)Csockaddr::mum(h ^ 0xe7037ed1a0b428dbull, getTail() ^ 0x8ebc6af09c88c6e3ull);
 		}
 	};
 
@@ -544,6 +665,10 @@ namespace NETWORK_POOL
 		}
 	};
 
+	// Handle of a tcp connection assigned by pool(0 is invalid).
+	// It's tagged with generation, so handle of a closed connection is detected even if the slot is reused.
+	typedef uint64_t __connection_handle;
+
 	struct __network_hash
 	{
 		size_t operator()(const CnetworkNode& k) const
@@ -19,6 +19,10 @@
  * SOFTWARE.
  */
 
+#ifndef _WIN32
+	#include <unistd.h>
+#endif
+
 #include "network_pool.h"
 #include "np_dbg.h"
 
@@ -38,7 +42,7 @@ namespace NETWORK_POOL
 		// Every tcp_alloc_buffer will follow a on_tcp_read, so we don't care about the closing.
 		void *buffer = nullptr;
 		size_t length = 0;
-		tcp->getPool()->m_callback.allocateMemoryForMessage(tcp->getNode(), suggested_size, buffer, length);
+		tcp->getPool()->m_callback.allocateMemoryForMessage(tcp->getNode(), tcp->getHandle(), tcp->getContext(), suggested_size, buffer, length);
 		buf->base = (char *)buffer;
 	#ifdef _MSC_VER
 		buf->len = (ULONG)length;
@@ -47,23 +51,33 @@ namespace NETWORK_POOL
 	#endif
 	}
 
-	void on_tcp_timeout(uv_timer_t *handle)
+	void on_tcp_timeout(__timer_node *timeout)
 	{
-		Ctcp *tcp = Ctcp::obtain(handle);
+		Ctcp *tcp = Ctcp::obtain(timeout);
 		tcp->getPool()->shutdownTcpConnection_set_nullptr(tcp);
 	}
 
+	void on_timer_tick(uv_timer_t *handle)
+	{
+		CnetworkPool::__loop *loop = CnetworkPool::obtainLoop(handle->loop);
+		loop->m_timers.advance(uv_now(handle->loop));
+		if (loop->m_timers.empty())
+			uv_timer_stop(handle); // Started again by next timeout.
+	}
+
+	void on_budget_tick(uv_timer_t *handle)
+	{
+		CnetworkPool::__loop *loop = CnetworkPool::obtainLoop(handle->loop);
+		if (!loop->m_pool->m_memoryTrace.isOverSoftBudget())
+			loop->m_pool->resumeReads(*loop);
+	}
+
 	// This function should be called at last and the tcp ***MUST*** be no closing and no shutdown.
-	// Note: It will shutdown tcp if set timer fail.
-	void reset_tcp_idle_timeout_may_set_nullptr(Ctcp *& tcp)
+	void reset_tcp_idle_timeout(Ctcp *tcp)
 	{
 		// Reset idle timeout if needed.
 		if (0 == tcp->getStream()->write_queue_size) // Use uv_stream_get_write_queue_size in libuv 1.19.0.
-		{
-			// No pending send, reset the timer.
-			if (uv_timer_start(tcp->getTimer(), on_tcp_timeout, tcp->getPool()->getSettings().tcp_idle_timeout_in_seconds * 1000, 0) != 0)
-				tcp->getPool()->shutdownTcpConnection_set_nullptr(tcp);
-		}
+			tcp->getPool()->startTimeout(tcp, tcp->getPool()->getSettings().tcp_idle_timeout_in_seconds); // No pending send, reset the timer.
 	}
 
 	void on_tcp_read(uv_stream_t *client, ssize_t nread, const uv_buf_t *buf)
@@ -73,15 +87,16 @@ namespace NETWORK_POOL
 		if (nread > 0)
 		{
 			// Report message.
-			pool->m_callback.message(tcp->getNode(), buf->base, nread);
-			pool->m_callback.deallocateMemoryForMessage(tcp->getNode(), buf->base, buf->len);
+			pool->m_callback.message(tcp->getNode(), tcp->getHandle(), tcp->getContext(), buf->base, nread);
+			pool->m_callback.deallocateMemoryForMessage(tcp->getNode(), tcp->getHandle(), tcp->getContext(), buf->base, buf->len);
 			// Reset idle close.
 			if (!tcp->isClosing() && !tcp->isShutdown())
-				reset_tcp_idle_timeout_may_set_nullptr(tcp);
+				reset_tcp_idle_timeout(tcp);
+			pool->checkBudget(*CnetworkPool::obtainLoop(client->loop));
 		}
 		else
 		{
-			pool->m_callback.deallocateMemoryForMessage(tcp->getNode(), buf->base, buf->len);
+			pool->m_callback.deallocateMemoryForMessage(tcp->getNode(), tcp->getHandle(), tcp->getContext(), buf->base, buf->len);
 			if (nread < 0)
 			{
 				if (nread != UV_EOF)
@@ -101,22 +116,28 @@ namespace NETWORK_POOL
 		{
 			NP_FPRINTF((stderr, "Tcp write error %s.\n", uv_strerror(status)));
 			// Notify the message drop.
-			for (size_t i = 0; i < writeInfo->num; ++i)
-				pool->m_callback.drop(tcp->getNode(), writeInfo->buf[i].base, writeInfo->buf[i].len);
+			pool->dropWrite(tcp->getNode(), writeInfo);
 			// Shutdown connection.
 			pool->shutdownTcpConnection_set_nullptr(tcp);
 		}
 		else if (!tcp->isClosing() && !tcp->isShutdown())
-			reset_tcp_idle_timeout_may_set_nullptr(tcp);
+		{
+			pool->updateWriteWatermark(tcp);
+			reset_tcp_idle_timeout(tcp);
+		}
 		// Free write buffer.
 		for (size_t i = 0; i < writeInfo->num; ++i)
-			pool->getMemoryTrace()._free_set_nullptr(writeInfo->buf[i].base);
+		{
+			if (!writeInfo->isInline(i))
+				pool->freeBuffer(writeInfo->buf[i], writeInfo->shared()[i]);
+		}
 		pool->getMemoryTrace()._free_set_nullptr(writeInfo);
 	}
 
 	void on_new_connection(uv_stream_t *server, int status)
 	{
 		CnetworkPool *pool = Ctcp::obtain(server)->getPool();
+		CnetworkPool::__loop *loop = CnetworkPool::obtainLoop(server->loop);
 		if (status != 0)
 		{
 			// WTF? Listen fail?
@@ -126,7 +147,7 @@ namespace NETWORK_POOL
 			return;
 		}
 		// Prepare for the new connection.
-		Ctcp *clientTcp = Ctcp::alloc(pool, &pool->m_loop);
+		Ctcp *clientTcp = Ctcp::alloc(pool, &loop->m_loop, pool->getSettings().tcp_context_size);
 		if (nullptr == clientTcp)
 		{
 			// Just return.
@@ -136,6 +157,8 @@ namespace NETWORK_POOL
 		on_error_goto_ec(
 			uv_accept(server, clientTcp->getStream()),
 			(stderr, "New incoming connection tcp accept error.\n"));
+		if (pool->m_memoryTrace.isOverSoftBudget())
+			goto_ec((stderr, "New incoming connection rejected over memory budget.\n"));
 		sockaddr_storage peer;
 		int len;
 		len = sizeof(peer);
@@ -145,12 +168,10 @@ namespace NETWORK_POOL
 		if (!clientTcp->getNode().set(CnetworkNode::protocol_tcp, (const sockaddr *)&peer, len))
 			goto_ec((stderr, "New incoming connection tcp set node error.\n"));
 		// Do the port reuse check.
-		if (pool->getStreamByNode(clientTcp->getNode()) != nullptr)
+		if (pool->getStreamByNode(*loop, clientTcp->getNode()) != nullptr)
 			goto_ec((stderr, "New incoming connection tcp remote port reuse.\n"));
 		// Set idle timeout.
-		on_error_goto_ec(
-			uv_timer_start(clientTcp->getTimer(), on_tcp_timeout, pool->getSettings().tcp_idle_timeout_in_seconds * 1000, 0),
-			(stderr, "New incoming connection tcp timer start error.\n"));
+		pool->startTimeout(clientTcp, pool->getSettings().tcp_idle_timeout_in_seconds);
 		// Start read.
 		on_error_goto_ec(
 			uv_read_start(clientTcp->getStream(), tcp_alloc_buffer, on_tcp_read),
@@ -167,15 +188,13 @@ namespace NETWORK_POOL
 		Ctcp *tcp = Ctcp::obtain(req->handle);
 		CnetworkPool *pool = tcp->getPool();
 		// Remove from connecting and free request.
-		pool->m_connecting.erase(tcp);
+		CnetworkPool::obtainLoop(req->handle->loop)->m_connecting.erase(tcp);
 		pool->getMemoryTrace()._free_set_nullptr(req);
 		// Error?
 		if (status < 0 || tcp->isClosing()) // Closing may happen when deleting the pool with the connecting not completed.
 			goto_ec((stderr, "Connect tcp error %s.\n", uv_strerror(status)));
 		// Set timeout.
-		on_error_goto_ec(
-			uv_timer_start(tcp->getTimer(), on_tcp_timeout, tcp->getPool()->getSettings().tcp_idle_timeout_in_seconds * 1000, 0),
-			(stderr, "Connect tcp timer start error.\n"));
+		pool->startTimeout(tcp, pool->getSettings().tcp_idle_timeout_in_seconds);
 		// Start read.
 		on_error_goto_ec(
 			uv_read_start(tcp->getStream(), tcp_alloc_buffer, on_tcp_read),
@@ -188,11 +207,59 @@ namespace NETWORK_POOL
 		pool->shutdownTcpConnection_set_nullptr(tcp, true);
 	}
 
+	static inline void closeSocket(uv_os_sock_t sock)
+	{
+	#ifdef _WIN32
+		if (sock != INVALID_SOCKET)
+			closesocket(sock);
+	#else
+		if (sock >= 0)
+			::close(sock);
+	#endif
+	}
+
+	static inline uv_os_sock_t invalidSocket()
+	{
+	#ifdef _WIN32
+		return INVALID_SOCKET;
+	#else
+		return -1;
+	#endif
+	}
+
+	static inline bool validSocket(uv_os_sock_t sock)
+	{
+	#ifdef _WIN32
+		return sock != INVALID_SOCKET;
+	#else
+		return sock >= 0;
+	#endif
+	}
+
+	// Create a socket with SO_REUSEPORT, so each loop can bind its own socket on the same address.
+	static uv_os_sock_t createReusePortSocket(const CnetworkNode& node, int type)
+	{
+	#ifdef SO_REUSEPORT
+		uv_os_sock_t sock = socket(node.getSockaddr().getSockaddr()->sa_family, type, 0);
+		if (!validSocket(sock))
+			return sock;
+		int on = 1;
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)
+		{
+			closeSocket(sock);
+			return invalidSocket();
+		}
+		return sock;
+	#else
+		return invalidSocket();
+	#endif
+	}
+
 	static Ctcp *bindAndListenTcp(CnetworkPool *pool, uv_loop_t *loop, const CnetworkNode& node)
 	{
 		if (node.getProtocol() != CnetworkNode::protocol_tcp)
 			return nullptr;
-		Ctcp *server = Ctcp::alloc(pool, loop, false);
+		Ctcp *server = Ctcp::alloc(pool, loop);
 		if (nullptr == server)
 		{
 			// Insufficient memory.
@@ -200,6 +267,17 @@ namespace NETWORK_POOL
 			return nullptr;
 		}
 		server->getNode() = node;
+		if (pool->getSettings().tcp_enable_reuseport)
+		{
+			uv_os_sock_t sock = createReusePortSocket(node, SOCK_STREAM);
+			if (!validSocket(sock))
+				goto_ec((stderr, "Bind and listen tcp reuse port socket error.\n"));
+			if (uv_tcp_open(server->getTcp(), sock) != 0)
+			{
+				closeSocket(sock);
+				goto_ec((stderr, "Bind and listen tcp open error.\n"));
+			}
+		}
 		on_error_goto_ec(
 			uv_tcp_bind(server->getTcp(), server->getNode().getSockaddr().getSockaddr(), 0),
 			(stderr, "Bind and listen tcp bind error.\n"));
@@ -212,18 +290,57 @@ namespace NETWORK_POOL
 		return nullptr;
 	}
 
+	// Duplicate the listening socket of the first loop, so other loops can accept on it.
+	static uv_os_sock_t duplicateTcpServer(Ctcp *server)
+	{
+	#ifdef _WIN32
+		return INVALID_SOCKET; // Not supported, and the first loop accepts all connections.
+	#else
+		uv_os_fd_t fd;
+		if (uv_fileno((uv_handle_t *)server->getTcp(), &fd) != 0)
+			return -1;
+		return dup(fd);
+	#endif
+	}
+
+	static Ctcp *listenSharedTcp(CnetworkPool *pool, uv_loop_t *loop, const CnetworkNode& node, uv_os_sock_t sock)
+	{
+		Ctcp *server = Ctcp::alloc(pool, loop);
+		if (nullptr == server)
+		{
+			// Insufficient memory.
+			NP_FPRINTF((stderr, "Listen shared tcp error with insufficient memory.\n"));
+			closeSocket(sock);
+			return nullptr;
+		}
+		server->getNode() = node;
+		if (uv_tcp_open(server->getTcp(), sock) != 0)
+		{
+			NP_FPRINTF((stderr, "Listen shared tcp open error.\n"));
+			closeSocket(sock);
+			goto _ec;
+		}
+		on_error_goto_ec(
+			uv_listen(server->getStream(), pool->getSettings().tcp_backlog, on_new_connection),
+			(stderr, "Listen shared tcp listen error.\n"));
+		return server;
+	_ec:
+		Ctcp::close_set_nullptr(server);
+		return nullptr;
+	}
+
 	static Ctcp *connectTcp(CnetworkPool *pool, uv_loop_t *loop, const CnetworkNode& node)
 	{
 		if (node.getProtocol() != CnetworkNode::protocol_tcp)
 			return nullptr;
-		uv_connect_t *connect = (uv_connect_t *)pool->getMemoryTrace()._malloc_no_throw(sizeof(uv_connect_t));
+		uv_connect_t *connect = (uv_connect_t *)pool->getMemoryTrace()._malloc_no_throw(sizeof(uv_connect_t), tag_connection);
 		if (nullptr == connect)
 		{
 			// Insufficient memory.
 			NP_FPRINTF((stderr, "Connect tcp error with insufficient memory.\n"));
 			return nullptr;
 		}
-		Ctcp *tcp = Ctcp::alloc(pool, loop);
+		Ctcp *tcp = Ctcp::alloc(pool, loop, pool->getSettings().tcp_context_size);
 		if (nullptr == tcp)
 		{
 			// Insufficient memory.
@@ -233,10 +350,6 @@ namespace NETWORK_POOL
 			return nullptr;
 		}
 		tcp->getNode() = node;
-		// Set timeout.
-		on_error_goto_ec(
-			uv_timer_start(tcp->getTimer(), on_tcp_timeout, pool->getSettings().tcp_connect_timeout_in_seconds * 1000, 0),
-			(stderr, "Connect tcp timer start error.\n"));
 		// Connect.
 		on_error_goto_ec(
 			uv_tcp_connect(connect, tcp->getTcp(), tcp->getNode().getSockaddr().getSockaddr(), on_connect_done),
@@ -298,7 +411,10 @@ namespace NETWORK_POOL
 		}
 		// Free udp send buffer.
 		for (size_t i = 0; i < udpSendInfo->num; ++i)
-			pool->getMemoryTrace()._free_set_nullptr(udpSendInfo->buf[i].base);
+		{
+			if (!udpSendInfo->isInline(i))
+				pool->freeBuffer(udpSendInfo->buf[i], udpSendInfo->shared()[i]);
+		}
 		pool->getMemoryTrace()._free_set_nullptr(udpSendInfo);
 	}
 
@@ -314,6 +430,17 @@ namespace NETWORK_POOL
 			return nullptr;
 		}
 		server->getNode() = node;
+		if (pool->getSettings().udp_enable_reuseport)
+		{
+			uv_os_sock_t sock = createReusePortSocket(node, SOCK_DGRAM);
+			if (!validSocket(sock))
+				goto_ec((stderr, "Bind and listen udp reuse port socket error.\n"));
+			if (uv_udp_open(server->getUdp(), sock) != 0)
+			{
+				closeSocket(sock);
+				goto_ec((stderr, "Bind and listen udp open error.\n"));
+			}
+		}
 		on_error_goto_ec(
 			uv_udp_bind(server->getUdp(), server->getNode().getSockaddr().getSockaddr(), 0),
 			(stderr, "Bind and listen udp bind error.\n"));
@@ -329,41 +456,40 @@ namespace NETWORK_POOL
 	void on_wakeup(uv_async_t *async)
 	{
 		CnetworkPool *pool = Casync::obtain(async)->getPool();
-		// Copy pending to local first.
-		pool->m_lock.lock(); // Just use lock and unlock, because we never get exception here(fatal error).
-		std::deque<std::pair<CnetworkNode, bool>> bindCopy(std::move(pool->m_pendingBind));
-		std::deque<CnetworkPool::__pending_send> sendCopy(std::move(pool->m_pendingSend));
-		std::deque<std::pair<CnetworkNode, bool>> closeCopy(std::move(pool->m_pendingClose));
-		pool->m_pendingBind.clear();
-		pool->m_pendingSend.clear();
-		pool->m_pendingClose.clear();
-		pool->m_lock.unlock();
+		CnetworkPool::__loop *loop = CnetworkPool::obtainLoop(async->loop);
 		// Deal with request(s).
 		if (pool->m_bWantExit)
 		{
 			//
 			// Stop and free all resources.
 			//
-			// Async.
-			Casync::close_set_nullptr(pool->m_wakeup);
+			// Async(close under lock, so no one will wake up this loop any more).
+			loop->m_lock.lock(); // Just use lock and unlock, because we never get exception here(fatal error).
+			Casync::close_set_nullptr(loop->m_wakeup);
+			loop->m_lock.unlock();
+			// Timer of timeouts(tcp timeouts are canceled when closing) and budget.
+			uv_close((uv_handle_t *)&loop->m_tick, nullptr);
+			uv_close((uv_handle_t *)&loop->m_budgetTick, nullptr);
 			// TCP servers.
-			std::unordered_map<CnetworkNode, Ctcp *, __network_hash> tmpTcpServers(std::move(pool->m_tcpServers));
-			pool->m_tcpServers.clear();
+			CflatMap<CnetworkNode, Ctcp *, __network_hash> tmpTcpServers(std::move(loop->m_tcpServers));
+			loop->m_tcpServers.clear();
 			for (auto& pair : tmpTcpServers)
 			{
-				// Report bind down.
-				pool->m_callback.bindStatus(pair.first, false);
+				// Report bind down(only the first loop reports).
+				if (0 == loop->m_index)
+					pool->m_callback.bindStatus(pair.first, false);
 				// Close.
 				Ctcp::close_set_nullptr(pair.second);
 			}
 			tmpTcpServers.clear();
 			// UDP servers.
-			std::vector<Cudp *> tmpUdpServers(std::move(pool->m_udpServers));
-			pool->m_udpServers.clear();
+			std::vector<Cudp *> tmpUdpServers(std::move(loop->m_udpServers));
+			loop->m_udpServers.clear();
 			for (auto& server : tmpUdpServers)
 			{
-				// Report bind down.
-				pool->m_callback.bindStatus(server->getNode(), false);
+				// Report bind down(only the first loop reports).
+				if (0 == loop->m_index)
+					pool->m_callback.bindStatus(server->getNode(), false);
 				// Close.
 				Cudp *tmp = server;
 				uv_udp_recv_stop(tmp->getUdp()); // Ignore the result.
@@ -371,323 +497,943 @@ namespace NETWORK_POOL
 			}
 			tmpUdpServers.clear();
 			// TCP connections.
-			std::unordered_map<CnetworkNode, Ctcp *, __network_hash> tmpNode2stream(std::move(pool->m_node2stream));
-			pool->m_node2stream.clear();
+			CflatMap<CnetworkNode, Ctcp *, __network_hash> tmpNode2stream(std::move(loop->m_node2stream));
+			loop->m_node2stream.clear();
 			for (auto& pair : tmpNode2stream)
 			{
+				if (loop->m_index != pool->getOwnerIndex(pair.first))
+					pool->removeRoute(pair.first);
+				if (pair.second->isCongested())
+					pool->setCongested(pair.second, false);
 				// Report connection down.
-				pool->m_callback.connectionStatus(pair.second->getNode(), false);
+				pool->m_callback.connectionStatus(pair.second->getNode(), pair.second->getHandle(), pair.second->getContext(), false);
+				pair.second->getContext() = nullptr;
 				// Close.
 				Ctcp::close_set_nullptr(pair.second);
 			}
 			tmpNode2stream.clear();
 			// TCP connecting.
-			std::unordered_set<Ctcp *> tmpConnecting(std::move(pool->m_connecting));
-			pool->m_connecting.clear();
+			std::unordered_set<Ctcp *> tmpConnecting(std::move(loop->m_connecting));
+			loop->m_connecting.clear();
 			for (auto& connect : tmpConnecting)
 			{
 				// Report connection down.
-				pool->m_callback.connectionStatus(connect->getNode(), false);
+				void *context = nullptr;
+				pool->m_callback.connectionStatus(connect->getNode(), 0, context, false);
 				// Close.
 				Ctcp *tmp = connect;
 				Ctcp::close_set_nullptr(tmp);
 			}
 			tmpConnecting.clear();
-			// Drop all waiting message.
-			for (auto& pair : pool->m_waitingSend)
+			// TCP shutting down(peer may never read, and timer of send timeout is closed), only these are left unclosed now.
+			uv_walk(&loop->m_loop, [](uv_handle_t *handle, void *arg)
 			{
-				const CnetworkNode& node = pair.first;
-				for (auto& buf : pair.second)
+				if (UV_TCP == handle->type && !uv_is_closing(handle))
 				{
-					pool->m_callback.drop(node, buf.base, buf.len);
-					pool->getMemoryTrace()._free_set_nullptr(buf.base);
+					Ctcp *tcp = Ctcp::obtainFromTcp(handle);
+					Ctcp::close_set_nullptr(tcp);
 				}
+			}, nullptr);
+			// Drop all waiting message.
+			for (auto& pair : loop->m_waitingSend)
+			{
+				const CnetworkNode& node = pair.first;
+				for (auto& waiting : pair.second)
+					pool->dropBuffer(node, waiting.buf, waiting.shared);
+			}
+			loop->m_waitingSend.clear();
+			// Drop all pending request(s).
+			CnetworkPool::__pending_request *req;
+			while ((req = (CnetworkPool::__pending_request *)loop->m_pending.pop()) != nullptr)
+			{
+				pool->dropRequest(*req);
+				pool->freeRequest_set_nullptr(req);
 			}
-			pool->m_waitingSend.clear();
-			// Drop all pending bind & message.
-			for (const auto& pair : bindCopy)
-				pool->m_callback.bindStatus(pair.first, false);
-			for (const auto& req : sendCopy)
-				pool->m_callback.drop(req.m_node, req.m_data.getData(), req.m_data.getLength());
 		}
 		else
 		{
 			//
-			// Bind, send & close.
+			// Bind, send & close in order of request.
 			//
-			// Bind.
-			for (const auto& pair : bindCopy)
+			// Clear signal first, so request pushed after this will signal again.
+			loop->m_signaled.exchange(false, std::memory_order_acq_rel);
+			unsigned int budget = pool->getSettings().loop_wakeup_budget;
+			CnetworkPool::__pending_request *req;
+			while ((req = (CnetworkPool::__pending_request *)loop->m_pending.pop()) != nullptr)
 			{
-				const CnetworkNode& node = pair.first;
-				const bool& bBind = pair.second;
-				switch (node.getProtocol())
+				const bool bRouted = req->m_bRouted;
+				CnetworkNode routed;
+				if (bRouted)
+				{
+					routed = req->m_node; // Request may be forwarded or freed.
+					req->m_bRouted = false; // Not counted again if forwarded.
+				}
+				switch (req->m_type)
+				{
+				case CnetworkPool::__pending_request::request_bind:
+					pool->processBind_may_set_nullptr(*loop, req);
+					break;
+
+				case CnetworkPool::__pending_request::request_bind_result:
+					pool->processBindResult(*loop, *req);
+					break;
+
+				case CnetworkPool::__pending_request::request_send:
+					pool->coalesceSend_set_nullptr(*loop, req);
+					break;
+
+				case CnetworkPool::__pending_request::request_close:
+					pool->processClose(*loop, *req);
+					break;
+
+				default:
+					break;
+				}
+				pool->freeRequest_set_nullptr(req); // No need to check nullptr.
+				if (bRouted)
+					pool->releaseRoute(routed);
+				if (budget != 0 && 0 == --budget)
+				{
+					// Budget exhausted, deal with the remaining in next iteration.
+					pool->wakeup(*loop);
+					break;
+				}
+			}
+			// One write for each connection.
+			pool->flushCoalesced(*loop);
+		}
+	}
+
+	inline bool CnetworkPool::postShardBind(__loop& loop, const CnetworkNode& node, const bool bBind, const uv_os_sock_t sock)
+	{
+		__pending_request *req = m_memoryTrace._new_no_throw<__pending_request, tag_pending_request>(m_memoryTrace, __pending_request::request_bind, node);
+		if (nullptr == req)
+		{
+			// Insufficient memory.
+			NP_FPRINTF((stderr, "Post shard bind error with insufficient memory.\n"));
+			if (bBind)
+				closeSocket(sock);
+			return false;
+		}
+		req->m_bBind = bBind;
+		req->m_bShard = true;
+		req->m_sock = sock;
+		postInternal(loop, req);
+		return true;
+	}
+
+	// Called by the first loop after shard binds are posted.
+	inline void CnetworkPool::waitShardBind(__loop& loop, const CnetworkNode& node, const size_t waiting, const bool bFailed)
+	{
+		__shard_bind bind = { waiting, 1, bFailed };
+		if (waiting > 0)
+		{
+			try
+			{
+				loop.m_shardBinds.insert(std::make_pair(node, bind));
+				return;
+			}
+			catch (...)
+			{
+				bind.m_bFailed = true; // Insufficient memory, and replies will be ignored.
+			}
+		}
+		finishShardBind(loop, node, bind);
+	}
+
+	inline void CnetworkPool::finishShardBind(__loop& loop, const CnetworkNode& node, const __shard_bind& bind)
+	{
+		if (bind.m_bFailed)
+		{
+			// Unbind on all loops.
+			if (CnetworkNode::protocol_tcp == node.getProtocol())
+			{
+				auto it = loop.m_tcpServers.find(node);
+				if (it != loop.m_tcpServers.end())
 				{
-				case CnetworkNode::protocol_tcp:
+					Ctcp *tcp = it->second;
+					loop.m_tcpServers.erase(it);
+					Ctcp::close_set_nullptr(tcp);
+				}
+			}
+			else
+			{
+				for (auto udpServerIt = loop.m_udpServers.begin(); udpServerIt != loop.m_udpServers.end(); ++udpServerIt)
 				{
-					auto it = pool->m_tcpServers.find(node);
-					if (it != pool->m_tcpServers.end())
+					if ((*udpServerIt)->getNode() == node)
 					{
-						if (bBind)
-							pool->m_callback.bindStatus(node, true);
-						else
-						{
-							// Unbind.
-							Ctcp *tcp = it->second;
-							pool->m_tcpServers.erase(it);
-							pool->m_callback.bindStatus(node, false);
-							Ctcp::close_set_nullptr(tcp);
-						}
+						Cudp *udp = *udpServerIt;
+						loop.m_udpServers.erase(udpServerIt);
+						uv_udp_recv_stop(udp->getUdp()); // Ignore the result.
+						Cudp::close_set_nullptr(udp);
+						break;
 					}
+				}
+			}
+			for (size_t i = 1; i < m_loops.size(); ++i)
+				postShardBind(*m_loops[i], node, false, invalidSocket());
+		}
+		for (size_t i = 0; i < bind.m_reports; ++i)
+			m_callback.bindStatus(node, !bind.m_bFailed);
+	}
+
+	// Set nullptr if request is replied to the first loop.
+	inline void CnetworkPool::processBind_may_set_nullptr(__loop& loop, __pending_request *& req)
+	{
+		const CnetworkNode& node = req->m_node;
+		const bool bBind = req->m_bBind;
+		if (req->m_bShard)
+		{
+			// Listening socket shared from the first loop, or bind with reuse port.
+			bool bSuccess = true;
+			if (CnetworkNode::protocol_tcp == node.getProtocol())
+			{
+				auto it = loop.m_tcpServers.find(node);
+				if (bBind)
+				{
+					if (it != loop.m_tcpServers.end())
+						closeSocket(req->m_sock);
 					else
 					{
-						if (bBind)
-						{
-							// Bind.
-							Ctcp *tcpServer = bindAndListenTcp(pool, &pool->m_loop, node);
-							if (tcpServer != nullptr)
-								pool->m_tcpServers.insert(std::make_pair(node, tcpServer));
-							pool->m_callback.bindStatus(node, tcpServer != nullptr);
-						}
+						Ctcp *tcpServer = validSocket(req->m_sock) ?
+							listenSharedTcp(this, &loop.m_loop, node, req->m_sock) : bindAndListenTcp(this, &loop.m_loop, node);
+						if (tcpServer != nullptr)
+							loop.m_tcpServers.insert(std::make_pair(node, tcpServer));
 						else
-							pool->m_callback.bindStatus(node, false);
+							bSuccess = false;
 					}
 				}
-					break;
-				case CnetworkNode::protocol_udp:
+				else if (it != loop.m_tcpServers.end())
 				{
-					auto udpServerIt = pool->m_udpServers.begin();
-					for (; udpServerIt != pool->m_udpServers.end(); ++udpServerIt)
-					{
-						if ((*udpServerIt)->getNode() == node)
-							break;
-					}
-					if (udpServerIt != pool->m_udpServers.end())
+					Ctcp *tcp = it->second;
+					loop.m_tcpServers.erase(it);
+					Ctcp::close_set_nullptr(tcp);
+				}
+			}
+			else if (CnetworkNode::protocol_udp == node.getProtocol())
+			{
+				auto udpServerIt = loop.m_udpServers.begin();
+				for (; udpServerIt != loop.m_udpServers.end(); ++udpServerIt)
+				{
+					if ((*udpServerIt)->getNode() == node)
+						break;
+				}
+				if (bBind)
+				{
+					if (udpServerIt == loop.m_udpServers.end())
 					{
-						// Found.
-						if (bBind)
-							pool->m_callback.bindStatus(node, true);
+						Cudp *udpServer = bindAndListenUdp(this, &loop.m_loop, node);
+						if (udpServer != nullptr)
+							loop.m_udpServers.push_back(udpServer);
 						else
-						{
-							// Unbind.
-							Cudp *udp = *udpServerIt;
-							pool->m_udpServers.erase(udpServerIt);
-							pool->m_callback.bindStatus(node, false);
-							uv_udp_recv_stop(udp->getUdp()); // Ignore the result.
-							Cudp::close_set_nullptr(udp);
-						}
+							bSuccess = false;
 					}
+				}
+				else if (udpServerIt != loop.m_udpServers.end())
+				{
+					Cudp *udp = *udpServerIt;
+					loop.m_udpServers.erase(udpServerIt);
+					uv_udp_recv_stop(udp->getUdp()); // Ignore the result.
+					Cudp::close_set_nullptr(udp);
+				}
+			}
+			if (bBind)
+			{
+				if (!bSuccess)
+					NP_FPRINTF((stderr, "Shard bind error on loop %u.\n", (unsigned int)loop.m_index));
+				// Reply to the first loop with the request.
+				req->m_type = __pending_request::request_bind_result;
+				req->m_bBind = bSuccess;
+				req->m_bShard = false;
+				req->m_sock = invalidSocket();
+				postInternal(*m_loops[0], req);
+				req = nullptr;
+			}
+			return;
+		}
+		switch (node.getProtocol())
+		{
+		case CnetworkNode::protocol_tcp:
+		{
+			auto it = loop.m_tcpServers.find(node);
+			if (it != loop.m_tcpServers.end())
+			{
+				auto bindIt = loop.m_shardBinds.find(node);
+				if (bBind)
+				{
+					if (bindIt != loop.m_shardBinds.end())
+						++bindIt->second.m_reports; // Report when all loops are done.
 					else
+						m_callback.bindStatus(node, true);
+				}
+				else
+				{
+					// Unbind.
+					if (bindIt != loop.m_shardBinds.end())
+					{
+						// Bind not done, so just report unbound.
+						for (size_t i = 0; i < bindIt->second.m_reports; ++i)
+							m_callback.bindStatus(node, false);
+						loop.m_shardBinds.erase(bindIt);
+					}
+					Ctcp *tcp = it->second;
+					loop.m_tcpServers.erase(it);
+					m_callback.bindStatus(node, false);
+					Ctcp::close_set_nullptr(tcp);
+					// Unbind on other loops.
+					for (size_t i = 1; i < m_loops.size(); ++i)
+						postShardBind(*m_loops[i], node, false, invalidSocket());
+				}
+			}
+			else
+			{
+				if (bBind)
+				{
+					// Bind.
+					Ctcp *tcpServer = bindAndListenTcp(this, &loop.m_loop, node);
+					if (tcpServer != nullptr)
 					{
-						// Not found.
-						if (bBind)
+						loop.m_tcpServers.insert(std::make_pair(node, tcpServer));
+						// Listen on other loops(each loop binds its own socket if reuse port).
+						size_t waiting = 0;
+						bool bFailed = false;
+						for (size_t i = 1; i < m_loops.size(); ++i)
 						{
-							// Bind.
-							Cudp *udpServer = bindAndListenUdp(pool, &pool->m_loop, node);
-							if (udpServer != nullptr)
-								pool->m_udpServers.push_back(udpServer);
-							pool->m_callback.bindStatus(node, udpServer != nullptr);
+							uv_os_sock_t sock = m_settings.tcp_enable_reuseport ? invalidSocket() : duplicateTcpServer(tcpServer);
+							if (!m_settings.tcp_enable_reuseport && !validSocket(sock))
+								continue; // Dup not supported(e.g. Windows), and the loop doesn't accept.
+							if (postShardBind(*m_loops[i], node, true, sock))
+								++waiting;
+							else
+								bFailed = true;
 						}
-						else
-							pool->m_callback.bindStatus(node, false);
+						waitShardBind(loop, node, waiting, bFailed);
 					}
+					else
+						m_callback.bindStatus(node, false);
 				}
-				break;
-
-				default:
-					pool->m_callback.bindStatus(node, false);
+				else
+					m_callback.bindStatus(node, false);
+			}
+		}
+			break;
+		case CnetworkNode::protocol_udp:
+		{
+			auto udpServerIt = loop.m_udpServers.begin();
+			for (; udpServerIt != loop.m_udpServers.end(); ++udpServerIt)
+			{
+				if ((*udpServerIt)->getNode() == node)
 					break;
-				}
 			}
-			// Send.
-			for (auto& req : sendCopy)
+			if (udpServerIt != loop.m_udpServers.end())
 			{
-				const CnetworkNode& node = req.m_node;
-				Cbuffer& data = req.m_data;
-				const bool& bAutoConnect = req.m_bAutoConnect;
-				switch (node.getProtocol())
+				// Found.
+				auto bindIt = loop.m_shardBinds.find(node);
+				if (bBind)
 				{
-				case CnetworkNode::protocol_tcp:
+					if (bindIt != loop.m_shardBinds.end())
+						++bindIt->second.m_reports; // Report when all loops are done.
+					else
+						m_callback.bindStatus(node, true);
+				}
+				else
 				{
-					Ctcp *tcp = pool->getStreamByNode(node);
-					if (nullptr == tcp)
+					// Unbind.
+					if (bindIt != loop.m_shardBinds.end())
 					{
-						// Check if any waiting data, start connect if no waiting.
-						bool bNeedConnect = pool->m_waitingSend.find(node) == pool->m_waitingSend.end();
-						if (bNeedConnect && !bAutoConnect)
-							pool->m_callback.drop(node, data.getData(), data.getLength()); // Just drop.
-						else
+						// Bind not done, so just report unbound.
+						for (size_t i = 0; i < bindIt->second.m_reports; ++i)
+							m_callback.bindStatus(node, false);
+						loop.m_shardBinds.erase(bindIt);
+					}
+					Cudp *udp = *udpServerIt;
+					loop.m_udpServers.erase(udpServerIt);
+					m_callback.bindStatus(node, false);
+					uv_udp_recv_stop(udp->getUdp()); // Ignore the result.
+					Cudp::close_set_nullptr(udp);
+					// Unbind on other loops.
+					if (m_settings.udp_enable_reuseport)
+					{
+						for (size_t i = 1; i < m_loops.size(); ++i)
+							postShardBind(*m_loops[i], node, false, invalidSocket());
+					}
+				}
+			}
+			else
+			{
+				// Not found.
+				if (bBind)
+				{
+					// Bind.
+					Cudp *udpServer = bindAndListenUdp(this, &loop.m_loop, node);
+					if (udpServer != nullptr)
+					{
+						loop.m_udpServers.push_back(udpServer);
+						// Bind on other loops with reuse port.
+						size_t waiting = 0;
+						bool bFailed = false;
+						if (m_settings.udp_enable_reuseport)
 						{
-							pool->pushWaiting(node, data);
-							if (bNeedConnect)
+							for (size_t i = 1; i < m_loops.size(); ++i)
 							{
-								tcp = connectTcp(pool, &pool->m_loop, node);
-								if (nullptr == tcp)
-								{
-									// Connect fail.
-									pool->m_callback.connectionStatus(node, false);
-									pool->dropWaiting(node);
-								}
-								else // Put in connecting set.
-									pool->m_connecting.insert(tcp);
+								if (postShardBind(*m_loops[i], node, true, invalidSocket()))
+									++waiting;
+								else
+									bFailed = true;
 							}
 						}
+						waitShardBind(loop, node, waiting, bFailed);
 					}
 					else
+						m_callback.bindStatus(node, false);
+				}
+				else
+					m_callback.bindStatus(node, false);
+			}
+		}
+		break;
+
+		default:
+			m_callback.bindStatus(node, false);
+			break;
+		}
+	}
+
+	// The first loop collects results of shard binds.
+	inline void CnetworkPool::processBindResult(__loop& loop, __pending_request& req)
+	{
+		auto it = loop.m_shardBinds.find(req.m_node);
+		if (it == loop.m_shardBinds.end())
+			return; // Unbound before all loops are done.
+		if (!req.m_bBind)
+			it->second.m_bFailed = true;
+		if (0 == --it->second.m_waiting)
+		{
+			__shard_bind bind = it->second;
+			loop.m_shardBinds.erase(it);
+			finishShardBind(loop, req.m_node, bind);
+		}
+	}
+
+	// Set nullptr if request is forwarded to other loop.
+	inline void CnetworkPool::processSend_may_set_nullptr(__loop& loop, __pending_request *& req)
+	{
+		const CnetworkNode& node = req->m_node;
+		const bool& bAutoConnect = req->m_bAutoConnect;
+		size_t num = 0;
+		for (__pending_request *it = req; it != nullptr; it = it->m_more)
+			++num;
+		switch (node.getProtocol())
+		{
+		case CnetworkNode::protocol_tcp:
+		{
+			Ctcp *tcp = getStreamByNode(loop, node);
+			if (nullptr == tcp)
+			{
+				if (loop.m_index != getOwnerIndex(node))
+				{
+					// Connection accepted by this loop is down, and new connection must start on the owner loop.
+					// Route is kept until this is forwarded, so later requests queue behind it.
+					postInternal(*m_loops[getOwnerIndex(node)], req);
+					req = nullptr;
+					break;
+				}
+				// Check if any waiting data, start connect if no waiting.
+				bool bNeedConnect = loop.m_waitingSend.find(node) == loop.m_waitingSend.end();
+				if (bNeedConnect && !bAutoConnect)
+					dropSendData(*req); // Just drop.
+				else
+				{
+					pushWaiting(loop, node, *req);
+					if (bNeedConnect)
 					{
-						// Just use write.
-						CnetworkPool::__write_with_info *writeInfo = (CnetworkPool::__write_with_info *)pool->getMemoryTrace()._malloc_no_throw(sizeof(CnetworkPool::__write_with_info)); // Only one buf.
-						if (nullptr == writeInfo)
+						tcp = connectTcp(this, &loop.m_loop, node);
+						if (nullptr == tcp)
 						{
-							// Insufficient memory.
-							// Just drop.
-							NP_FPRINTF((stderr, "Send tcp error with insufficient memory.\n"));
-							pool->m_callback.drop(node, data.getData(), data.getLength());
+							// Connect fail.
+							void *context = nullptr;
+							m_callback.connectionStatus(node, 0, context, false);
+							dropWaiting(loop, node);
 						}
 						else
 						{
-							writeInfo->num = 1;
-							data.transfer(writeInfo->buf[0]);
-							// First reset timer and then send.
-							if (uv_timer_start(tcp->getTimer(), on_tcp_timeout, pool->getSettings().tcp_send_timeout_in_seconds * 1000, 0) != 0 ||
-								uv_write(&writeInfo->write, tcp->getStream(), writeInfo->buf, (unsigned int)writeInfo->num, on_tcp_write_done) != 0)
-							{
-								pool->dropWriteAndFree_set_nullptr(node, writeInfo);
-								// Shutdown connection.
-								pool->shutdownTcpConnection_set_nullptr(tcp);
-							}
+							// Set timeout and put in connecting set.
+							startTimeout(tcp, m_settings.tcp_connect_timeout_in_seconds);
+							loop.m_connecting.insert(tcp);
 						}
 					}
 				}
-				break;
+			}
+			else
+				writeTcp(tcp, *req);
+		}
+		break;
 
-				case CnetworkNode::protocol_udp:
-					if (pool->m_udpServers.size() > 0)
+		case CnetworkNode::protocol_udp:
+			if (loop.m_udpServers.size() > 0)
+			{
+				const size_t inlineLength = getInlineLength(*req);
+				__udp_send_with_info *udpSendInfo = (__udp_send_with_info *)m_memoryTrace._malloc_no_throw(__udp_send_with_info::size(num, inlineLength), tag_write_request);
+				if (udpSendInfo != nullptr)
+				{
+					udpSendInfo->num = num;
+					udpSendInfo->inlineLength = inlineLength;
+					char *inlineData = udpSendInfo->inlineData();
+					num = 0;
+					for (__pending_request *it = req; it != nullptr; it = it->m_more)
+					{
+						takeBuffer(*it, udpSendInfo->buf[num], udpSendInfo->shared()[num], inlineData);
+						++num;
+					}
+					loop.m_udpIndex %= loop.m_udpServers.size();
+					Cudp *sender = loop.m_udpServers[loop.m_udpIndex];
+					++loop.m_udpIndex;
+					int iRet = uv_udp_send(&udpSendInfo->udpSend, sender->getUdp(), udpSendInfo->buf, (unsigned int)udpSendInfo->num, node.getSockaddr().getSockaddr(), on_udp_send_done);
+					if (iRet != 0)
 					{
-						CnetworkPool::__udp_send_with_info *udpSendInfo = (CnetworkPool::__udp_send_with_info *)pool->getMemoryTrace()._malloc_no_throw(sizeof(CnetworkPool::__udp_send_with_info)); // Only one buf.
-						if (udpSendInfo != nullptr)
+						// Send fail.
+						// Free udp send buffer.
+						for (size_t i = 0; i < udpSendInfo->num; ++i)
 						{
-							udpSendInfo->num = 1;
-							data.transfer(udpSendInfo->buf[0]);
-							pool->m_udpIndex %= pool->m_udpServers.size();
-							Cudp *sender = pool->m_udpServers[pool->m_udpIndex];
-							++pool->m_udpIndex;
-							int iRet = uv_udp_send(&udpSendInfo->udpSend, sender->getUdp(), udpSendInfo->buf, (unsigned int)udpSendInfo->num, node.getSockaddr().getSockaddr(), on_udp_send_done);
-							if (iRet != 0)
-							{
-								// Send fail.
-								// Free udp send buffer.
-								for (size_t i = 0; i < udpSendInfo->num; ++i)
-									pool->getMemoryTrace()._free_set_nullptr(udpSendInfo->buf[i].base);
-								pool->getMemoryTrace()._free_set_nullptr(udpSendInfo);
-								// Just report this error.
-								pool->m_callback.udpSendError(sender->getNode(), iRet);
-							}
+							if (!udpSendInfo->isInline(i))
+								freeBuffer(udpSendInfo->buf[i], udpSendInfo->shared()[i]);
 						}
-					} // Ignore the fail, and udp don't send drop notification.
-				break;
-
-				default:
-					// Unknown protocol.
-					if (bAutoConnect)
-						pool->m_callback.connectionStatus(node, false);
-					pool->m_callback.drop(node, data.getData(), data.getLength());
-					break;
+						m_memoryTrace._free_set_nullptr(udpSendInfo);
+						// Just report this error.
+						m_callback.udpSendError(sender->getNode(), iRet);
+					}
 				}
+			} // Ignore the fail, and udp don't send drop notification.
+		break;
+
+		default:
+			// Unknown protocol.
+			if (bAutoConnect)
+				m_callback.connectionStatus(node, false);
+			dropSendData(*req);
+			break;
+		}
+	}
+
+	inline void CnetworkPool::processClose(__loop& loop, __pending_request& req)
+	{
+		const bool& bForceClose = req.m_bForceClose;
+		Ctcp *tcp = req.m_handle != 0 ? getStreamByHandle(loop, req.m_handle) : getStreamByNode(loop, req.m_node); // Tcp connections(checked before insert).
+		if (tcp != nullptr)
+		{
+			flushCoalesced(loop, tcp); // Keep data before close.
+			// No force close means shutdown, and it's a type of send.
+			// Timer still working until close, so timeout when shutdown will force close the connection.
+			if (!bForceClose)
+				startTimeout(tcp, m_settings.tcp_send_timeout_in_seconds);
+			shutdownTcpConnection_set_nullptr(tcp, false, !bForceClose);
+		}
+	}
+
+	inline void CnetworkPool::writeTcp(Ctcp *tcp, __pending_request& req)
+	{
+		size_t num = 0;
+		for (__pending_request *it = &req; it != nullptr; it = it->m_more)
+			++num;
+		const size_t inlineLength = getInlineLength(req);
+		__write_with_info *writeInfo = (__write_with_info *)m_memoryTrace._malloc_no_throw(__write_with_info::size(num, inlineLength), tag_write_request);
+		if (nullptr == writeInfo)
+		{
+			// Insufficient memory.
+			// Just drop.
+			NP_FPRINTF((stderr, "Send tcp error with insufficient memory.\n"));
+			for (__pending_request *it = &req; it != nullptr; it = it->m_more)
+				it->m_node = tcp->getNode(); // May be sent by handle.
+			dropSendData(req);
+			return;
+		}
+		writeInfo->num = num;
+		writeInfo->inlineLength = inlineLength;
+		char *inlineData = writeInfo->inlineData();
+		num = 0;
+		for (__pending_request *it = &req; it != nullptr; it = it->m_more)
+		{
+			takeBuffer(*it, writeInfo->buf[num], writeInfo->shared()[num], inlineData);
+			++num;
+		}
+		// First reset timer and then send.
+		startTimeout(tcp, m_settings.tcp_send_timeout_in_seconds);
+		if (uv_write(&writeInfo->write, tcp->getStream(), writeInfo->buf, (unsigned int)writeInfo->num, on_tcp_write_done) != 0)
+		{
+			dropWriteAndFree_set_nullptr(tcp->getNode(), writeInfo);
+			// Shutdown connection.
+			shutdownTcpConnection_set_nullptr(tcp);
+		}
+		else
+			updateWriteWatermark(tcp);
+	}
+
+	// Tcp sends to the same connection are chained and sent by one write in flushCoalesced.
+	// Sends without connection go to connect or waiting directly, so order is kept.
+	inline void CnetworkPool::coalesceSend_set_nullptr(__loop& loop, __pending_request *& req)
+	{
+		if (m_memoryTrace.isOverHardBudget())
+		{
+			// Just drop, and udp don't send drop notification.
+			if (req->m_handle != 0 || req->m_node.getProtocol() != CnetworkNode::protocol_udp)
+				dropSendData(*req);
+			return;
+		}
+		Ctcp *tcp = nullptr;
+		if (req->m_handle != 0)
+		{
+			tcp = getStreamByHandle(loop, req->m_handle);
+			if (nullptr == tcp)
+			{
+				dropSendData(*req); // Connection of handle is down.
+				return;
+			}
+		}
+		else if (CnetworkNode::protocol_tcp == req->m_node.getProtocol())
+			tcp = getStreamByNode(loop, req->m_node);
+		if (nullptr == tcp)
+		{
+			processSend_may_set_nullptr(loop, req);
+			return;
+		}
+		__pending_request *last = req;
+		while (last->m_more != nullptr)
+			last = last->m_more;
+		auto it = loop.m_coalescing.find(tcp);
+		if (it == loop.m_coalescing.end())
+		{
+			try
+			{
+				loop.m_coalescing.insert(std::make_pair(tcp, std::make_pair(req, last)));
 			}
-			// Close.
-			for (const auto& pair : closeCopy)
+			catch (...)
 			{
-				const CnetworkNode& node = pair.first;
-				const bool& bForceClose = pair.second;
-				Ctcp *tcp = pool->getStreamByNode(node); // Tcp connections(checked before insert).
-				if (tcp != nullptr)
-				{
-					// No force close means shutdown, and it's a type of send.
-					if (!bForceClose && uv_timer_start(tcp->getTimer(), on_tcp_timeout, pool->getSettings().tcp_send_timeout_in_seconds * 1000, 0) != 0)
-						pool->shutdownTcpConnection_set_nullptr(tcp);
-					else // Timer still working until close, so timeout when shutdown will force close the connection.
-						pool->shutdownTcpConnection_set_nullptr(tcp, false, !bForceClose);
-				}
+				// Insufficient memory, just send it alone.
+				writeTcp(tcp, *req);
+				return;
+			}
+		}
+		else
+		{
+			// Auto connect only matters without connection, so chain sends of any flag.
+			it->second.second->m_more = req;
+			it->second.second = last;
+		}
+		req = nullptr;
+	}
+
+	inline void CnetworkPool::flushCoalesced(__loop& loop, Ctcp *tcp)
+	{
+		auto it = loop.m_coalescing.find(tcp);
+		if (it == loop.m_coalescing.end())
+			return;
+		__pending_request *req = it->second.first;
+		loop.m_coalescing.erase(it);
+		writeTcp(tcp, *req);
+		freeRequest_set_nullptr(req);
+	}
+
+	inline void CnetworkPool::flushCoalesced(__loop& loop)
+	{
+		// Connection only closes(and its close callback is deferred) in its own write here,
+		// so all connections are valid, and just clear after all done(and keep the buckets).
+		for (auto& pair : loop.m_coalescing)
+		{
+			__pending_request *req = pair.second.first;
+			writeTcp(pair.first, *req);
+			freeRequest_set_nullptr(req);
+		}
+		loop.m_coalescing.clear();
+	}
+
+	// Drop the request when the pool is exiting.
+	inline void CnetworkPool::dropRequest(__pending_request& req)
+	{
+		switch (req.m_type)
+		{
+		case __pending_request::request_bind:
+			if (req.m_bShard)
+			{
+				if (req.m_bBind)
+					closeSocket(req.m_sock);
 			}
+			else
+				m_callback.bindStatus(req.m_node, false);
+			break;
+
+		case __pending_request::request_send:
+			dropSendData(req);
+			break;
+
+		default:
+			break;
 		}
 	}
 
-	inline Ctcp *CnetworkPool::getStreamByNode(const CnetworkNode& node)
+	inline Ctcp *CnetworkPool::getStreamByNode(__loop& loop, const CnetworkNode& node)
 	{
-		auto it = m_node2stream.find(node);
-		if (it == m_node2stream.end())
+		auto it = loop.m_node2stream.find(node);
+		if (it == loop.m_node2stream.end())
 			return nullptr;
 		return it->second;
 	}
 
-	inline void CnetworkPool::dropWaiting(const CnetworkNode& node)
+	inline Ctcp *CnetworkPool::getStreamByHandle(__loop& loop, const __connection_handle handle)
+	{
+		size_t slot = (size_t)(handle & ((1u << s_handleSlotBits) - 1));
+		if (slot >= loop.m_handles.size() || loop.m_handles[slot].m_generation != (uint32_t)(handle >> (s_handleLoopBits + s_handleSlotBits)))
+			return nullptr;
+		return loop.m_handles[slot].m_tcp;
+	}
+
+	// Connection without handle(slots exhausted or insufficient memory) is still working by node.
+	inline void CnetworkPool::allocHandle(__loop& loop, Ctcp *tcp)
+	{
+		size_t slot;
+		if (!loop.m_freeHandles.empty())
+		{
+			slot = loop.m_freeHandles.back();
+			loop.m_freeHandles.pop_back();
+		}
+		else
+		{
+			slot = loop.m_handles.size();
+			if (slot >= ((size_t)1 << s_handleSlotBits))
+				return;
+			try
+			{
+				loop.m_handles.push_back(__handle_slot{ nullptr, 1 });
+			}
+			catch (...)
+			{
+				return;
+			}
+		}
+		__handle_slot& handleSlot = loop.m_handles[slot];
+		handleSlot.m_tcp = tcp;
+		tcp->setHandle(((__connection_handle)handleSlot.m_generation << (s_handleLoopBits + s_handleSlotBits)) |
+			((__connection_handle)loop.m_index << s_handleSlotBits) | slot);
+	}
+
+	inline void CnetworkPool::freeHandle(__loop& loop, Ctcp *tcp)
+	{
+		if (0 == tcp->getHandle())
+			return;
+		size_t slot = (size_t)(tcp->getHandle() & ((1u << s_handleSlotBits) - 1));
+		tcp->setHandle(0);
+		__handle_slot& handleSlot = loop.m_handles[slot];
+		handleSlot.m_tcp = nullptr;
+		if (0 == ++handleSlot.m_generation)
+			handleSlot.m_generation = 1;
+		try
+		{
+			loop.m_freeHandles.push_back((uint32_t)slot);
+		}
+		catch (...)
+		{
+			// Insufficient memory, just leave the slot unused.
+		}
+	}
+
+	inline void CnetworkPool::dropWaiting(__loop& loop, const CnetworkNode& node)
+	{
+		auto waitingIt = loop.m_waitingSend.find(node);
+		if (waitingIt != loop.m_waitingSend.end())
+		{
+			for (auto& waiting : waitingIt->second)
+				dropBuffer(node, waiting.buf, waiting.shared);
+			loop.m_waitingSend.erase(waitingIt);
+		}
+	}
+
+	inline void CnetworkPool::pushWaiting(__loop& loop, const CnetworkNode& node, __pending_request& req)
 	{
-		auto waitingIt = m_waitingSend.find(node);
-		if (waitingIt != m_waitingSend.end())
+		auto it = loop.m_waitingSend.find(node);
+		if (it == loop.m_waitingSend.end())
+			it = loop.m_waitingSend.insert(std::make_pair(node, std::vector<__waiting_buffer>())).first;
+		char *inlineData = nullptr; // Small payload is allocated, because waiting may be long.
+		for (__pending_request *more = &req; more != nullptr; more = more->m_more)
 		{
-			for (auto& buf : waitingIt->second)
+			__waiting_buffer waiting;
+			takeBuffer(*more, waiting.buf, waiting.shared, inlineData);
+			if (nullptr == waiting.shared)
+				m_memoryTrace._retag(waiting.buf.base, tag_waiting);
+			it->second.push_back(waiting);
+		}
+	}
+
+	inline size_t CnetworkPool::getInlineLength(__pending_request& req)
+	{
+		size_t length = 0;
+		for (__pending_request *it = &req; it != nullptr; it = it->m_more)
+			length += it->m_inlineLength;
+		return length;
+	}
+
+	// Small payload is copied to inline data(and move it forward), or allocated when inline data is nullptr.
+	inline void CnetworkPool::takeBuffer(__pending_request& req, uv_buf_t& buf, CsharedBuffer::__block *& shared, char *& inlineData)
+	{
+		if (req.m_inlineLength > 0)
+		{
+			shared = nullptr;
+			if (inlineData != nullptr)
 			{
-				m_callback.drop(node, buf.base, buf.len);
-				m_memoryTrace._free_set_nullptr(buf.base);
+				memcpy(inlineData, req.m_inline, req.m_inlineLength);
+				buf.base = inlineData;
+			#ifdef _MSC_VER
+				buf.len = (ULONG)req.m_inlineLength;
+			#else
+				buf.len = req.m_inlineLength;
+			#endif
+				inlineData += req.m_inlineLength;
 			}
-			m_waitingSend.erase(waitingIt);
+			else
+			{
+				req.m_data.set(req.m_inline, req.m_inlineLength); // May throw.
+				m_memoryTrace._retag(req.m_data.getData(), tag_send_payload);
+				req.m_data.transfer(buf);
+			}
+			req.m_inlineLength = 0;
+		}
+		else if (req.m_shared != nullptr)
+		{
+			shared = req.m_shared;
+			req.m_shared = nullptr;
+			buf.base = shared->getData();
+		#ifdef _MSC_VER
+			buf.len = (ULONG)shared->m_length;
+		#else
+			buf.len = shared->m_length;
+		#endif
+		}
+		else
+		{
+			shared = nullptr;
+			req.m_data.transfer(buf);
 		}
 	}
 
-	inline void CnetworkPool::pushWaiting(const CnetworkNode& node, Cbuffer& data)
+	inline void CnetworkPool::freeBuffer(uv_buf_t& buf, CsharedBuffer::__block *& shared)
 	{
-		uv_buf_t buf;
-		data.transfer(buf);
-		auto it = m_waitingSend.find(node);
-		if (it == m_waitingSend.end())
-			m_waitingSend.insert(std::make_pair(node, std::vector<uv_buf_t>(1, buf)));
+		if (shared != nullptr)
+		{
+			CsharedBuffer::release_set_nullptr(shared);
+			buf.base = nullptr;
+		}
 		else
-			it->second.push_back(buf);
+			m_memoryTrace._free_set_nullptr(buf.base);
+	}
+
+	// Buffer is given to callback, and freed if not taken.
+	// Shared buffer is only notified by drop, because it can't be given away.
+	inline void CnetworkPool::dropBuffer(const CnetworkNode& node, uv_buf_t& buf, CsharedBuffer::__block *& shared)
+	{
+		if (shared != nullptr)
+		{
+			m_callback.drop(node, buf.base, buf.len);
+			freeBuffer(buf, shared);
+			return;
+		}
+		Cbuffer data(&m_memoryTrace);
+		data.adopt(buf);
+		m_callback.dropBuffer(node, data);
+	}
+
+	inline void CnetworkPool::dropSendData(__pending_request& req)
+	{
+		for (__pending_request *more = &req; more != nullptr; more = more->m_more)
+		{
+			if (more->m_shared != nullptr)
+				m_callback.drop(req.m_node, more->m_shared->getData(), more->m_shared->m_length);
+			else if (more->m_inlineLength > 0)
+				m_callback.drop(req.m_node, more->m_inline, more->m_inlineLength);
+			else
+				m_callback.dropBuffer(req.m_node, more->m_data);
+		}
 	}
 
 	inline void CnetworkPool::dropWriteAndFree_set_nullptr(const CnetworkNode& node, __write_with_info *& writeInfo)
 	{
 		// Notify message drop and delete it.
+		dropWrite(node, writeInfo);
+		m_memoryTrace._free_set_nullptr(writeInfo);
+	}
+
+	inline void CnetworkPool::dropWrite(const CnetworkNode& node, __write_with_info *writeInfo)
+	{
 		for (size_t i = 0; i < writeInfo->num; ++i)
 		{
-			m_callback.drop(node, writeInfo->buf[i].base, writeInfo->buf[i].len);
-			m_memoryTrace._free_set_nullptr(writeInfo->buf[i].base);
+			if (writeInfo->isInline(i))
+				m_callback.drop(node, writeInfo->buf[i].base, writeInfo->buf[i].len); // Freed with write request.
+			else
+				dropBuffer(node, writeInfo->buf[i], writeInfo->shared()[i]);
 		}
-		m_memoryTrace._free_set_nullptr(writeInfo);
 	}
 
-	inline CnetworkPool::__write_with_info *CnetworkPool::getWriteFromWaitingByNode(const CnetworkNode& node)
+	inline CnetworkPool::__write_with_info *CnetworkPool::getWriteFromWaitingByNode(__loop& loop, const CnetworkNode& node)
 	{
-		auto it = m_waitingSend.find(node);
-		if (it == m_waitingSend.end())
+		auto it = loop.m_waitingSend.find(node);
+		if (it == loop.m_waitingSend.end())
 			return nullptr;
-		__write_with_info *writeInfo = (__write_with_info *)m_memoryTrace._malloc_no_throw(sizeof(__write_with_info) + sizeof(uv_buf_t)*(it->second.size() - 1));
+		__write_with_info *writeInfo = (__write_with_info *)m_memoryTrace._malloc_no_throw(__write_with_info::size(it->second.size(), 0), tag_write_request);
 		if (nullptr == writeInfo)
 		{
 			// Insufficient memory.
 			// Just drop.
 			NP_FPRINTF((stderr, "Send tcp error with insufficient memory.\n"));
-			dropWaiting(node);
+			dropWaiting(loop, node);
 			return nullptr;
 		}
 		writeInfo->num = it->second.size();
+		writeInfo->inlineLength = 0;
 		for (size_t i = 0; i < writeInfo->num; ++i)
-			writeInfo->buf[i] = it->second[i];
-		m_waitingSend.erase(it);
+		{
+			writeInfo->buf[i] = it->second[i].buf;
+			writeInfo->shared()[i] = it->second[i].shared;
+			if (nullptr == writeInfo->shared()[i])
+				m_memoryTrace._retag(writeInfo->buf[i].base, tag_send_payload);
+		}
+		loop.m_waitingSend.erase(it);
 		return writeInfo;
 	}
 
+	inline void CnetworkPool::checkBudget(__loop& loop)
+	{
+		if (loop.m_bReadPaused || !m_memoryTrace.isOverSoftBudget())
+			return;
+		// Stop reads of all connections on this loop, and check by timer until usage falls.
+		NP_FPRINTF((stderr, "Memory over soft budget, pause reads.\n"));
+		loop.m_bReadPaused = true;
+		for (auto& pair : loop.m_node2stream)
+			uv_read_stop(pair.second->getStream());
+		uv_timer_start(&loop.m_budgetTick, on_budget_tick, s_budgetTickInMs, s_budgetTickInMs); // Never fail on active loop.
+	}
+
+	inline void CnetworkPool::resumeReads(__loop& loop)
+	{
+		NP_FPRINTF((stderr, "Memory below soft budget, resume reads.\n"));
+		loop.m_bReadPaused = false;
+		uv_timer_stop(&loop.m_budgetTick);
+		for (auto& pair : loop.m_node2stream)
+		{
+			Ctcp *tcp = pair.second;
+			if (!tcp->isClosing() && !tcp->isShutdown() && uv_read_start(tcp->getStream(), tcp_alloc_buffer, on_tcp_read) != 0)
+				NP_FPRINTF((stderr, "Resume tcp read error.\n")); // Connection is closed by idle timeout.
+		}
+	}
+
 	inline void CnetworkPool::startupTcpConnection_may_set_nullptr(Ctcp *& tcp)
 	{
-		if (!tcp->getNode().getSockaddr().valid())
+		if (!tcp->getNode().valid())
 		{
 			// WTF to get here? The only thing we can do is just close it.
 			NP_FPRINTF((stderr, "Fatal error startup a connection whithout node.\n"));
 			Ctcp::close_set_nullptr(tcp);
 			return;
 		}
+		__loop& loop = *obtainLoop(tcp->getTcp()->loop);
 		// Add map.
-		auto ib = m_node2stream.insert(std::make_pair(tcp->getNode(), tcp));
+		auto ib = loop.m_node2stream.insert(std::make_pair(tcp->getNode(), tcp));
 		if (!ib.second)
 		{
 			// Remote port reuse?
@@ -697,32 +1443,54 @@ namespace NETWORK_POOL
 			Ctcp::close_set_nullptr(tcp);
 			return;
 		}
+		// Add route if not on the owner loop(accepted by other loop).
+		if (loop.m_index != getOwnerIndex(tcp->getNode()) ? !addRoute(tcp->getNode(), loop.m_index) : &getLoopByNode(tcp->getNode()) != &loop)
+		{
+			// Remote port reuse on other loop.
+			NP_FPRINTF((stderr, "Error startup a connection with remote port reuse on other loop.\n"));
+			loop.m_node2stream.erase(ib.first);
+			Ctcp::close_set_nullptr(tcp);
+			return;
+		}
+		if (loop.m_bReadPaused)
+			uv_read_stop(tcp->getStream()); // Started by resumeReads.
 		// Report new connection.
-		m_callback.connectionStatus(tcp->getNode(), true);
+		allocHandle(loop, tcp);
+		tcp->getContext() = m_settings.tcp_context_size > 0 ? tcp->getContextStorage() : nullptr;
+		m_callback.connectionStatus(tcp->getNode(), tcp->getHandle(), tcp->getContext(), true);
 		// Send message waiting.
-		__write_with_info *writeInfo = getWriteFromWaitingByNode(tcp->getNode());
+		__write_with_info *writeInfo = getWriteFromWaitingByNode(loop, tcp->getNode());
 		if (writeInfo != nullptr)
 		{
 			// Something need to send. First reset timer and then send.
-			if (uv_timer_start(tcp->getTimer(), on_tcp_timeout, m_settings.tcp_send_timeout_in_seconds * 1000, 0) != 0 ||
-				uv_write(&writeInfo->write, tcp->getStream(), writeInfo->buf, (unsigned int)writeInfo->num, on_tcp_write_done) != 0)
+			startTimeout(tcp, m_settings.tcp_send_timeout_in_seconds);
+			if (uv_write(&writeInfo->write, tcp->getStream(), writeInfo->buf, (unsigned int)writeInfo->num, on_tcp_write_done) != 0)
 			{
 				dropWriteAndFree_set_nullptr(tcp->getNode(), writeInfo);
 				// Shutdown connection.
 				shutdownTcpConnection_set_nullptr(tcp);
 			}
+			else
+				updateWriteWatermark(tcp);
 		}
 	}
 
 	// This function is idempotent, and can be called any time when tcp is valid(closing is also ok).
 	inline void CnetworkPool::shutdownTcpConnection_set_nullptr(Ctcp *& tcp, bool bAlwaysNotify, bool bShutdown)
 	{
+		__loop& loop = *obtainLoop(tcp->getTcp()->loop);
 		// Clean map.
-		auto sz = m_node2stream.erase(tcp->getNode());
+		auto sz = loop.m_node2stream.erase(tcp->getNode());
+		if (sz > 0 && loop.m_index != getOwnerIndex(tcp->getNode()))
+			closeRoute(tcp->getNode());
+		if (tcp->isCongested())
+			setCongested(tcp, false);
 		if (sz > 0 || bAlwaysNotify)
-			m_callback.connectionStatus(tcp->getNode(), false); // Report connection down.
+			m_callback.connectionStatus(tcp->getNode(), tcp->getHandle(), tcp->getContext(), false); // Report connection down.
+		tcp->getContext() = nullptr; // Reads after shutdown have no context.
+		freeHandle(loop, tcp);
 		// Notify the message drop.
-		dropWaiting(tcp->getNode());
+		dropWaiting(loop, tcp->getNode());
 		// Close connection.
 		if (bShutdown)
 			Ctcp::shutdown_and_close_set_nullptr(tcp);
@@ -730,23 +1498,95 @@ namespace NETWORK_POOL
 			Ctcp::close_set_nullptr(tcp);
 	}
 
-	void CnetworkPool::internalThread()
+	void CnetworkPool::internalThread(__loop *loop)
 	{
 		// Init loop.
-		if (uv_loop_init(&m_loop) != 0)
+		if (uv_loop_init(&loop->m_loop) != 0)
+		{
+			loop->m_state = bad;
+			return;
+		}
+		loop->m_loop.data = loop;
+		uv_timer_init(&loop->m_loop, &loop->m_tick); // Never fail.
+		uv_timer_init(&loop->m_loop, &loop->m_budgetTick); // Never fail.
+		loop->m_timers.reset(uv_now(&loop->m_loop));
+		loop->m_wakeup = Casync::alloc(this, &loop->m_loop, on_wakeup);
+		if (nullptr == loop->m_wakeup)
 		{
-			m_state = bad;
+			uv_close((uv_handle_t *)&loop->m_tick, nullptr);
+			uv_close((uv_handle_t *)&loop->m_budgetTick, nullptr);
+			uv_run(&loop->m_loop, UV_RUN_DEFAULT); // Complete the close.
+			uv_loop_close(&loop->m_loop);
+			loop->m_state = bad;
 			return;
 		}
-		m_wakeup = Casync::alloc(this, &m_loop, on_wakeup);
-		if (nullptr == m_wakeup)
+		loop->m_state = good;
+		uv_run(&loop->m_loop, UV_RUN_DEFAULT);
+		uv_loop_close(&loop->m_loop);
+	}
+
+	void CnetworkPool::prewarm()
+	{
+		if (m_settings.enable_huge_page)
+			__allocator_enable_huge_page(true);
+		const size_t number = m_settings.tcp_prewarm_connection_number;
+		if (0 == number)
+			return;
+		// Sizes as allocated by memory trace, which has a size header.
+		__allocator_reserve(sizeof(size_t) + sizeof(Ctcp) + m_settings.tcp_context_size, number);
+		__allocator_reserve(sizeof(size_t) + sizeof(uv_connect_t), number);
+		__allocator_reserve(sizeof(size_t) + __write_with_info::size(1, 0), number);
+		__allocator_reserve(sizeof(size_t) + sizeof(__pending_request), number);
+		if (m_settings.tcp_prewarm_buffer_size > 0)
+			__allocator_reserve(sizeof(size_t) + m_settings.tcp_prewarm_buffer_size, number);
+		if (m_settings.loop_number > 1)
 		{
-			uv_loop_close(&m_loop);
-			m_state = bad;
+			for (auto& shard : m_routes)
+				shard.m_route.reserve(number / s_routeShardNumber + 1);
+		}
+	}
+
+	void CnetworkPool::prewarmLoop(__loop& loop)
+	{
+		const size_t number = m_settings.tcp_prewarm_connection_number / m_settings.loop_number;
+		if (0 == number)
 			return;
+		loop.m_node2stream.reserve(number);
+		loop.m_coalescing.reserve(number < 64 ? number : 64); // Only connections sent to in one wakeup, so a few are enough.
+		loop.m_handles.reserve(number);
+		loop.m_freeHandles.reserve(number);
+	}
+
+	void CnetworkPool::stopAndJoin()
+	{
+		m_bWantExit = true;
+		for (auto& loop : m_loops)
+		{
+			if (loop != nullptr)
+				wakeupInternal(*loop);
+		}
+		// Join all before free, because loop may post request to other loop.
+		for (auto& loop : m_loops)
+		{
+			if (loop != nullptr && loop->m_thread != nullptr)
+			{
+				loop->m_thread->join();
+				m_memoryTrace._delete_set_nullptr<std::thread>(loop->m_thread);
+			}
+		}
+		for (auto& loop : m_loops)
+		{
+			if (nullptr == loop)
+				continue;
+			// Requests posted after the loop exit.
+			__pending_request *req;
+			while ((req = (__pending_request *)loop->m_pending.pop()) != nullptr)
+			{
+				dropRequest(*req);
+				freeRequest_set_nullptr(req);
+			}
+			m_memoryTrace._delete_set_nullptr<__loop>(loop);
 		}
-		m_state = good;
-		uv_run(&m_loop, UV_RUN_DEFAULT);
-		uv_loop_close(&m_loop);
+		m_loops.clear();
 	}
 }
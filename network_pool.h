@@ -21,10 +21,9 @@
 
 #pragma once
 
+#include <atomic>
 #include <vector>
-#include <deque>
 #include <unordered_set>
-#include <unordered_map>
 #include <mutex>
 #include <thread>
 #include <utility>
@@ -36,12 +35,20 @@
 #include "network_node.h"
 #include "uv_wrapper.h"
 #include "buffer.h"
+#include "shared_buffer.h"
+#include "mpsc_queue.h"
+#include "flat_map.h"
+
+// Payload of send not larger than this is kept in the request and copied into the write request, so it needs no allocation.
+#ifndef NP_INLINE_SEND_SIZE
+	#define NP_INLINE_SEND_SIZE 64
+#endif
 
 namespace NETWORK_POOL
 {
 	//
 	// Caution! Program may cash when fail to allocate memory in critical step.
-	// So be careful to check memory usage before pushing packet to network pool.
+	// So be careful to check memory usage before pushing packet to network pool, or set budget of memory trace(see setBudget).
 	//
 	// TCP port reuse may cause some problem.
 	// Currently, we just reject the connection reuse the same ip and port which connect to same pool.
@@ -49,12 +56,26 @@ namespace NETWORK_POOL
 
 	struct __preferred_network_settings
 	{
+		// Pool settings.
+		// Number of event loops, and each loop runs in its own internal thread.
+		// Tcp connections are sharded across loops, and callbacks of a node always come from the same loop thread.
+		unsigned int loop_number;
+		// Max number of requests(bind, send & close) dealt in one wakeup, and the remaining are dealt in next iteration of loop.
+		// So reads and timers will not be starved by a burst of sends. Set 0 means no limit.
+		unsigned int loop_wakeup_budget;
+		// Memory of allocator(shared by process) is reserved in huge pages, which reduces TLB misses with many connections.
+		// Set it before the first pool starts, and it falls back to normal pages if huge page is not available.
+		int enable_huge_page;
 		// Tcp settings.
 		int tcp_enable_nodelay;
 		int tcp_enable_keepalive;
 		unsigned int tcp_keepalive_time_in_seconds;
 		int tcp_enable_simultaneous_accepts;
 		int tcp_backlog;
+		// Each loop binds its own listening socket with SO_REUSEPORT, and kernel spreads incoming connections.
+		// Otherwise the listening socket of the first loop is shared to other loops.
+		// Ignored if SO_REUSEPORT is not supported.
+		int tcp_enable_reuseport;
 		// Set 0 means use the system default value.
 		// Note: Linux will set double the size of the original set value.
 		int tcp_send_buffer_size;
@@ -63,107 +84,292 @@ namespace NETWORK_POOL
 		unsigned int tcp_connect_timeout_in_seconds;
 		unsigned int tcp_idle_timeout_in_seconds;
 		unsigned int tcp_send_timeout_in_seconds;
+		// Bytes allocated with each tcp connection for context of user(see connectionStatus of callback).
+		size_t tcp_context_size;
+		// Write queue watermarks in bytes of each tcp connection, set high watermark 0 to disable.
+		// Connection is not writable(see isWritable) when queue reaches high watermark,
+		// and writable of callback is called when queue drains to low watermark.
+		size_t tcp_write_high_watermark;
+		size_t tcp_write_low_watermark;
+		// Expected number of tcp connections, set 0 to disable pre-warm.
+		// Objects of each connection(tcp, connect request, write request, pending send and a buffer of tcp_prewarm_buffer_size)
+		// are reserved in allocator and their memory is pre-faulted at start, and so are the connection tables of loops.
+		// So the first connections after start are as fast as in steady state.
+		size_t tcp_prewarm_connection_number;
+		size_t tcp_prewarm_buffer_size;
 		// Udp settings.
 		int udp_ttl;
+		// Each loop binds its own udp socket with SO_REUSEPORT, and udp is sharded across loops like tcp.
+		// Otherwise all udp sockets are bound on the first loop.
+		// Ignored if SO_REUSEPORT is not supported.
+		int udp_enable_reuseport;
 
 		__preferred_network_settings()
 		{
+			loop_number = 1;
+			loop_wakeup_budget = 1024;
+			enable_huge_page = 0;
 			tcp_enable_nodelay = 1;
 			tcp_enable_keepalive = 1;
 			tcp_keepalive_time_in_seconds = 30;
 			tcp_enable_simultaneous_accepts = 1;
 			tcp_backlog = 128;
+			tcp_enable_reuseport = 0;
 			tcp_send_buffer_size = 0;
 			tcp_recv_buffer_size = 0;
 			tcp_connect_timeout_in_seconds = 10;
 			tcp_idle_timeout_in_seconds = 30;
 			tcp_send_timeout_in_seconds = 30;
+			tcp_context_size = 0;
+			tcp_write_high_watermark = 0;
+			tcp_write_low_watermark = 0;
+			tcp_prewarm_connection_number = 0;
+			tcp_prewarm_buffer_size = 0;
 			udp_ttl = 64;
+			udp_enable_reuseport = 0;
 		}
 	};
 
+	void on_tcp_timeout(__timer_node *timeout);
+	void on_timer_tick(uv_timer_t *handle);
+	void on_budget_tick(uv_timer_t *handle);
+
 	class CnetworkPool
 	{
 	public:
+		// Buffers are followed by the shared blocks(nullptr when buffer is not shared), and then the inline data.
+		// Inline data is small payload copied from request, and buffer of it needs no free.
 		struct __write_with_info
 		{
 			uv_write_t write;
 			size_t num;
+			size_t inlineLength;
 			uv_buf_t buf[1]; // Need free when complete request.
+
+			static inline size_t size(const size_t num, const size_t inlineLength)
+			{
+				return sizeof(__write_with_info) + sizeof(uv_buf_t)*(num - 1) + sizeof(CsharedBuffer::__block *)*num + inlineLength;
+			}
+			inline CsharedBuffer::__block **shared()
+			{
+				return (CsharedBuffer::__block **)(buf + num);
+			}
+			inline char *inlineData()
+			{
+				return (char *)(shared() + num);
+			}
+			inline bool isInline(const size_t index)
+			{
+				return buf[index].base >= inlineData() && buf[index].base < inlineData() + inlineLength;
+			}
 		};
 		struct __udp_send_with_info
 		{
 			uv_udp_send_t udpSend;
 			size_t num;
+			size_t inlineLength;
 			uv_buf_t buf[1]; // Need free when complete request.
+
+			static inline size_t size(const size_t num, const size_t inlineLength)
+			{
+				return sizeof(__udp_send_with_info) + sizeof(uv_buf_t)*(num - 1) + sizeof(CsharedBuffer::__block *)*num + inlineLength;
+			}
+			inline CsharedBuffer::__block **shared()
+			{
+				return (CsharedBuffer::__block **)(buf + num);
+			}
+			inline char *inlineData()
+			{
+				return (char *)(shared() + num);
+			}
+			inline bool isInline(const size_t index)
+			{
+				return buf[index].base >= inlineData() && buf[index].base < inlineData() + inlineLength;
+			}
+		};
+		// Buffer waiting for connection complete.
+		struct __waiting_buffer
+		{
+			uv_buf_t buf;
+			CsharedBuffer::__block *shared;
+		};
+
+		// Request which exchanged between internal and external.
+		struct __pending_request : public __mpsc_node
+		{
+			enum __request_type
+			{
+				request_bind = 0,
+				request_send,
+				request_close,
+				request_bind_result // Shard bind tells the first loop whether it is bound(in m_bBind).
+			} m_type;
+			CnetworkNode m_node;
+			Cbuffer m_data; // For send.
+			CsharedBuffer::__block *m_shared; // For send of shared buffer(m_data is empty).
+			__pending_request *m_more; // Following buffers of scatter-gather send.
+			bool m_bBind;
+			bool m_bAutoConnect;
+			bool m_bForceClose;
+			// Shard means a bind forwarded by the first loop to other loops.
+			// Socket is the shared listening socket, or invalid when bind with reuse port.
+			// Shard bind has no bind notification.
+			bool m_bShard;
+			bool m_bRouted; // Counted by route of node, see __route.
+			uv_os_sock_t m_sock;
+			__connection_handle m_handle; // Send or close by handle of tcp connection if not 0.
+			// Small payload is kept here(m_data is empty), see NP_INLINE_SEND_SIZE.
+			size_t m_inlineLength;
+			unsigned char m_inline[NP_INLINE_SEND_SIZE > 0 ? NP_INLINE_SEND_SIZE : 1];
+
+			// Copy data, inline if small.
+			inline void setData(CmemoryTrace& trace, const void *data, const size_t length)
+			{
+				if (length > 0 && length <= NP_INLINE_SEND_SIZE)
+				{
+					memcpy(m_inline, data, length);
+					m_inlineLength = length;
+				}
+				else
+				{
+					m_data.set(data, length);
+					trace._retag(m_data.getData(), tag_send_payload);
+				}
+			}
+
+			__pending_request(CmemoryTrace& trace, const __request_type type, const CnetworkNode& node)
+				:m_type(type), m_node(node), m_data(&trace), m_shared(nullptr), m_more(nullptr), m_bBind(false), m_bAutoConnect(false), m_bForceClose(false), m_bShard(false), m_bRouted(false), m_sock(0), m_handle(0), m_inlineLength(0) {}
+			__pending_request(CmemoryTrace& trace, const CnetworkNode& node, const void *data, const size_t length, const bool bAutoConnect)
+				:m_type(request_send), m_node(node), m_data(&trace), m_shared(nullptr), m_more(nullptr), m_bBind(false), m_bAutoConnect(bAutoConnect), m_bForceClose(false), m_bShard(false), m_bRouted(false), m_sock(0), m_handle(0), m_inlineLength(0)
+			{
+				setData(trace, data, length);
+			}
+			// Copy if data is traced by other memory trace, because it will be freed by the trace of pool.
+			__pending_request(CmemoryTrace& trace, const CnetworkNode& node, Cbuffer&& data, const bool bAutoConnect)
+				:m_type(request_send), m_node(node), m_data(data.getTrace() == &trace ? Cbuffer(std::move(data)) : Cbuffer(&trace)),
+				m_shared(nullptr), m_more(nullptr), m_bBind(false), m_bAutoConnect(bAutoConnect), m_bForceClose(false), m_bShard(false), m_bRouted(false), m_sock(0), m_handle(0), m_inlineLength(0)
+			{
+				if (data.getTrace() != &trace)
+					setData(trace, data.getData(), data.getLength());
+				else
+					trace._retag(m_data.getData(), tag_send_payload);
+			}
+			__pending_request(CmemoryTrace& trace, const CnetworkNode& node, const CsharedBuffer& data, const bool bAutoConnect)
+				:m_type(request_send), m_node(node), m_data(&trace), m_shared(data.retain()), m_more(nullptr), m_bBind(false), m_bAutoConnect(bAutoConnect), m_bForceClose(false), m_bShard(false), m_bRouted(false), m_sock(0), m_handle(0), m_inlineLength(0) {}
+			~__pending_request()
+			{
+				CsharedBuffer::release_set_nullptr(m_shared);
+			}
 		};
 
 	private:
+		static const uint64_t s_timerTickInMs = 100; // Precision of tcp timeouts.
+		static const uint64_t s_budgetTickInMs = 10; // Interval to check memory usage when reads are paused.
+
 		// Status of internal thread.
-		volatile enum __internal_state
+		enum __internal_state
 		{
 			initializing = 0,
 			good,
 			bad
-		} m_state;
+		};
 
 		__preferred_network_settings m_settings;
 		CmemoryTrace& m_memoryTrace;
 		CnetworkPoolCallback& m_callback;
 		bool m_bWantExit;
 
-		// Internal thread.
-		std::thread *m_thread;
+		struct __handle_slot
+		{
+			Ctcp *m_tcp; // nullptr if free.
+			uint32_t m_generation; // Never 0, so handle is never 0.
+		};
 
-		// Data which exchanged between internal and external.
-		std::mutex m_lock;
-		std::deque<std::pair<CnetworkNode, bool>> m_pendingBind;
-		struct __pending_send
+		// Bind is reported after all loops are bound, and unbound everywhere if any loop fails.
+		struct __shard_bind
 		{
-			CnetworkNode m_node;
-			Cbuffer m_data;
-			bool m_bAutoConnect;
+			size_t m_waiting; // Loops not replied.
+			size_t m_reports; // Bind requests to report.
+			bool m_bFailed;
+		};
 
-			__pending_send(CmemoryTrace& trace)
-				:m_data(&trace) {}
-			__pending_send(CmemoryTrace& trace, const CnetworkNode& node, const void *data, const size_t length, const bool bAutoConnect)
-				:m_node(node), m_data(&trace, data, length), m_bAutoConnect(bAutoConnect) {}
+		struct __loop
+		{
+			CnetworkPool *m_pool;
+			size_t m_index;
 
-			__pending_send(const __pending_send& another) = delete;
-			__pending_send(__pending_send&& another)
-				:m_node(std::move(another.m_node)), m_data(std::move(another.m_data)), m_bAutoConnect(another.m_bAutoConnect) {}
+			// Internal thread.
+			volatile __internal_state m_state;
+			std::thread *m_thread;
 
-			const __pending_send& operator=(const __pending_send& another) = delete;
-			const __pending_send& operator=(__pending_send&& another)
-			{
-				m_node = std::move(another.m_node);
-				m_data = std::move(another.m_data);
-				m_bAutoConnect = another.m_bAutoConnect;
-				return *this;
-			}
+			// Data which exchanged between internal and external.
+			CmpscQueue m_pending;
+			std::atomic<bool> m_signaled; // Skip redundant wakeup when already signaled and not dealt yet.
+			std::mutex m_lock; // Guard m_wakeup for wakeup from other loops and destructor.
+
+			//
+			// Following data must be accessed by internal thread.
+			//
+
+			// Use round robin to send message on UDP.
+			int m_udpIndex;
+
+			// Loop must be initialized in internal work thread.
+			uv_loop_t m_loop;
+			Casync *m_wakeup; // Set nullptr under m_lock when closing.
+			CflatMap<CnetworkNode, Ctcp *, __network_hash> m_tcpServers;
+			std::vector<Cudp *> m_udpServers;
+			CflatMap<CnetworkNode, __shard_bind, __network_hash> m_shardBinds; // First loop only.
+			CflatMap<CnetworkNode, Ctcp *, __network_hash> m_node2stream;
+			std::unordered_set<Ctcp *> m_connecting;
+			CflatMap<CnetworkNode, std::vector<__waiting_buffer>, __network_hash> m_waitingSend; // Waiting for connection complete.
+			CflatMap<Ctcp *, std::pair<__pending_request *, __pending_request *>> m_coalescing; // Tcp sends of one wakeup(first, last), written together.
+			// Tcp connections indexed by slot of handle, and released slots are reused with next generation.
+			std::vector<__handle_slot> m_handles;
+			std::vector<uint32_t> m_freeHandles;
+			// Timeouts of tcp connections, ticked by one timer only when any timeout is scheduled.
+			CtimerWheel m_timers;
+			uv_timer_t m_tick;
+			// Reads of tcp connections are stopped when memory is over soft budget, and checked by timer to resume.
+			bool m_bReadPaused;
+			uv_timer_t m_budgetTick;
+
+			__loop(CnetworkPool *pool, const size_t index)
+				:m_pool(pool), m_index(index), m_state(initializing), m_thread(nullptr), m_signaled(false), m_udpIndex(0), m_wakeup(nullptr),
+				m_timers(s_timerTickInMs, on_tcp_timeout), m_bReadPaused(false) {}
 		};
-		std::deque<__pending_send> m_pendingSend;
-		std::deque<std::pair<CnetworkNode, bool>> m_pendingClose;
-		
-		//
-		// Following data must be accessed by internal thread.
-		//
+		std::vector<__loop *> m_loops;
 
-		// Use round robin to send message on UDP.
-		int m_udpIndex;
+		// Handle is generation(32 bits), index of loop(8 bits) and slot in loop(24 bits).
+		static const unsigned int s_handleLoopBits = 8;
+		static const unsigned int s_handleSlotBits = 24;
 
-		// Loop must be initialized in internal work thread.
-		uv_loop_t m_loop;
-		Casync *m_wakeup;
-		std::unordered_map<CnetworkNode, Ctcp *, __network_hash> m_tcpServers;
-		std::vector<Cudp *> m_udpServers;
-		std::unordered_map<CnetworkNode, Ctcp *, __network_hash> m_node2stream;
-		std::unordered_set<Ctcp *> m_connecting;
-		std::unordered_map<CnetworkNode, std::vector<uv_buf_t>, __network_hash> m_waitingSend; // Waiting for connection complete.
+		// Tcp connection is owned by the loop selected by hash of node.
+		// Connection accepted by other loop is recorded here, so send and close can find it.
+		// When the connection is down, the route is kept until requests queued to the loop are forwarded to the owner loop,
+		// so requests posted later never overtake them.
+		struct __route
+		{
+			size_t m_index; // Loop of the connection.
+			size_t m_queued; // Requests posted to the loop and not processed yet.
+			bool m_bClosed;
+		};
+		struct __route_shard
+		{
+			std::mutex m_lock;
+			CflatMap<CnetworkNode, __route, __network_hash> m_route;
+			std::unordered_set<CnetworkNode, __network_hash> m_congested; // Tcp connections over high watermark.
+			std::unordered_set<__connection_handle> m_congestedHandles; // Same as above, but sharded by handle.
+		};
+		static const size_t s_routeShardNumber = 64;
+		__route_shard m_routes[s_routeShardNumber];
+		std::atomic<size_t> m_congestedNumber; // Skip lookup when no connection is congested.
 
 		friend void tcp_alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
-		friend void on_tcp_timeout(uv_timer_t *handle);
-		friend void reset_tcp_idle_timeout_may_set_nullptr(Ctcp *& tcp);
+		friend void on_tcp_timeout(__timer_node *timeout);
+		friend void on_timer_tick(uv_timer_t *handle);
+		friend void on_budget_tick(uv_timer_t *handle);
+		friend void reset_tcp_idle_timeout(Ctcp *tcp);
 		friend void on_tcp_read(uv_stream_t *client, ssize_t nread, const uv_buf_t *buf);
 		friend void on_tcp_write_done(uv_write_t *req, int status);
 		friend void on_new_connection(uv_stream_t *server, int status);
@@ -173,36 +379,127 @@ namespace NETWORK_POOL
 		friend void on_udp_send_done(uv_udp_send_t *req, int status);
 		friend void on_wakeup(uv_async_t *async);
 
-		inline Ctcp *getStreamByNode(const CnetworkNode& node);
-		inline void dropWaiting(const CnetworkNode& node);
-		inline void pushWaiting(const CnetworkNode& node, Cbuffer& data);
+		static inline __loop *obtainLoop(uv_loop_t *loop)
+		{
+			return (__loop *)loop->data;
+		}
+
+		// Routing of requests(thread safe).
+		inline size_t getOwnerIndex(const CnetworkNode& node) const
+		{
+			if (CnetworkNode::protocol_udp == node.getProtocol() && !m_settings.udp_enable_reuseport)
+				return 0; // All udp sockets are bound on the first loop.
+			return node.getHash() % m_loops.size();
+		}
+		inline __loop& getLoopByNode(const CnetworkNode& node);
+		inline __loop *getLoopByHandle(const __connection_handle handle);
+		inline bool addRoute(const CnetworkNode& node, const size_t index);
+		inline void removeRoute(const CnetworkNode& node);
+		inline void closeRoute(const CnetworkNode& node);
+		inline void releaseRoute(const CnetworkNode& node);
+		inline void startTimeout(Ctcp *tcp, const unsigned int seconds);
+		inline void setCongested(Ctcp *tcp, const bool congested);
+		inline void updateWriteWatermark(Ctcp *tcp);
+		inline void wakeup(__loop& loop);
+		inline void wakeupInternal(__loop& loop);
+		inline void post(__loop& loop, __pending_request *req);
+		inline void postByNode(const CnetworkNode& node, __pending_request *req);
+		inline void postInternal(__loop& loop, __pending_request *req);
+		inline bool postShardBind(__loop& loop, const CnetworkNode& node, const bool bBind, const uv_os_sock_t sock);
+
+		inline void freeRequest_set_nullptr(__pending_request *& req);
+
+		inline void waitShardBind(__loop& loop, const CnetworkNode& node, const size_t waiting, const bool bFailed);
+		inline void finishShardBind(__loop& loop, const CnetworkNode& node, const __shard_bind& bind);
+		inline void processBind_may_set_nullptr(__loop& loop, __pending_request *& req);
+		inline void processBindResult(__loop& loop, __pending_request& req);
+		inline void processSend_may_set_nullptr(__loop& loop, __pending_request *& req);
+		inline void processClose(__loop& loop, __pending_request& req);
+		inline void writeTcp(Ctcp *tcp, __pending_request& req);
+		inline void coalesceSend_set_nullptr(__loop& loop, __pending_request *& req);
+		inline void flushCoalesced(__loop& loop, Ctcp *tcp);
+		inline void flushCoalesced(__loop& loop);
+		inline void dropRequest(__pending_request& req);
+
+		inline Ctcp *getStreamByNode(__loop& loop, const CnetworkNode& node);
+		inline Ctcp *getStreamByHandle(__loop& loop, const __connection_handle handle);
+		inline void allocHandle(__loop& loop, Ctcp *tcp);
+		inline void freeHandle(__loop& loop, Ctcp *tcp);
+		inline void dropWaiting(__loop& loop, const CnetworkNode& node);
+		inline void pushWaiting(__loop& loop, const CnetworkNode& node, __pending_request& req);
+		inline size_t getInlineLength(__pending_request& req);
+		inline void takeBuffer(__pending_request& req, uv_buf_t& buf, CsharedBuffer::__block *& shared, char *& inlineData);
+		inline void freeBuffer(uv_buf_t& buf, CsharedBuffer::__block *& shared);
+		inline void dropBuffer(const CnetworkNode& node, uv_buf_t& buf, CsharedBuffer::__block *& shared);
+		inline void dropSendData(__pending_request& req);
 		inline void dropWriteAndFree_set_nullptr(const CnetworkNode& node, __write_with_info *& writeInfo);
-		inline __write_with_info *getWriteFromWaitingByNode(const CnetworkNode& node);
+		inline void dropWrite(const CnetworkNode& node, __write_with_info *writeInfo);
+		inline __write_with_info *getWriteFromWaitingByNode(__loop& loop, const CnetworkNode& node);
 
 		// Caution! Call following function(s) may cause iterator of m_node2stream and m_waitingSend invalid.
 		//          Following function(s) may set nullptr to tcp.
+		// Pause reads when memory is over soft budget, and resume when below.
+		inline void checkBudget(__loop& loop);
+		// Sends over hard budget are dropped by caller before allocating, and udp don't send drop notification(same as loop).
+		inline void dropOverHardBudget(const CnetworkNode& node, const void *data, const size_t length)
+		{
+			if (node.getProtocol() != CnetworkNode::protocol_udp)
+				m_callback.drop(node, data, length);
+		}
+		inline void dropOverHardBudget(const CnetworkNode& node, Cbuffer& data)
+		{
+			if (node.getProtocol() != CnetworkNode::protocol_udp)
+				m_callback.dropBuffer(node, data);
+		}
+		inline void resumeReads(__loop& loop);
 		inline void startupTcpConnection_may_set_nullptr(Ctcp *& tcp);
 		inline void shutdownTcpConnection_set_nullptr(Ctcp *& tcp, bool bAlwaysNotify = false, bool bShutdown = false);
 
-		void internalThread();
+		void internalThread(__loop *loop);
+		void stopAndJoin();
+		void prewarm();
+		void prewarmLoop(__loop& loop);
 
 	public:
 		// throw when fail.
 		CnetworkPool(const __preferred_network_settings& settings, CmemoryTrace& memoryTrace, CnetworkPoolCallback& callback)
-			:m_state(initializing), m_settings(settings), m_memoryTrace(memoryTrace), m_callback(callback), m_bWantExit(false), m_udpIndex(0), m_wakeup(nullptr)
+			:m_settings(settings), m_memoryTrace(memoryTrace), m_callback(callback), m_bWantExit(false), m_congestedNumber(0)
 		{
-			m_thread = m_memoryTrace._new_throw<std::thread>(&CnetworkPool::internalThread, this); // May throw.
-			while (initializing == m_state)
-				std::this_thread::yield();
-			if (m_state != good)
-				throw(-1);
+			if (0 == m_settings.loop_number)
+				m_settings.loop_number = 1;
+			if (m_settings.loop_number > (1u << s_handleLoopBits))
+				m_settings.loop_number = 1u << s_handleLoopBits; // Index of loop is in handle.
+			if (m_settings.tcp_write_low_watermark > m_settings.tcp_write_high_watermark)
+				m_settings.tcp_write_low_watermark = m_settings.tcp_write_high_watermark;
+		#ifndef SO_REUSEPORT
+			m_settings.tcp_enable_reuseport = 0;
+			m_settings.udp_enable_reuseport = 0;
+		#endif
+			try
+			{
+				prewarm(); // May throw.
+				m_loops.reserve(m_settings.loop_number);
+				for (size_t i = 0; i < m_settings.loop_number; ++i)
+				{
+					m_loops.push_back(nullptr);
+					m_loops.back() = m_memoryTrace._new_throw<__loop>(this, i); // May throw.
+					prewarmLoop(*m_loops.back()); // May throw.
+					m_loops.back()->m_thread = m_memoryTrace._new_throw<std::thread>(&CnetworkPool::internalThread, this, m_loops.back()); // May throw.
+					while (initializing == m_loops.back()->m_state)
+						std::this_thread::yield();
+					if (m_loops.back()->m_state != good)
+						throw(-1);
+				}
+			}
+			catch (...)
+			{
+				stopAndJoin();
+				throw;
+			}
 		}
 		~CnetworkPool()
 		{
-			m_bWantExit = true;
-			uv_async_send(m_wakeup->getAsync());
-			m_thread->join();
-			m_memoryTrace._delete_set_nullptr<std::thread>(m_thread);
+			stopAndJoin();
 		}
 
 		// No copy, no move.
@@ -223,12 +520,9 @@ namespace NETWORK_POOL
 		
 		void bind(const CnetworkNode& node, const bool bBind = true)
 		{
-			auto&& pair = std::make_pair(node, bBind);
-			{
-				std::lock_guard<std::mutex> guard(m_lock); // Use guard in case of exception.
-				m_pendingBind.push_back(pair);
-			}
-			uv_async_send(m_wakeup->getAsync());
+			__pending_request *req = m_memoryTrace._new_throw<__pending_request, tag_pending_request>(m_memoryTrace, __pending_request::request_bind, node);
+			req->m_bBind = bBind;
+			post(*m_loops[0], req); // The first loop deals with all binds.
 		}
 
 		// Binding a udp port is needed before sending a udp packet.
@@ -238,12 +532,148 @@ namespace NETWORK_POOL
 				return;
 			if (CnetworkNode::protocol_udp == node.getProtocol() && length > 65507)
 				return;
-			__pending_send temp(m_memoryTrace, node, data, length, bAutoConnect);
+			if (m_memoryTrace.isOverHardBudget())
+			{
+				dropOverHardBudget(node, data, length);
+				return;
+			}
+			postByNode(node, m_memoryTrace._new_throw<__pending_request, tag_pending_request>(m_memoryTrace, node, data, length, bAutoConnect));
+		}
+
+		// Send without copy, the data is moved into pool and written directly.
+		// The data will be given back by dropBuffer of callback when fail to send.
+		void send(const CnetworkNode& node, Cbuffer&& data, const bool bAutoConnect = false)
+		{
+			if (0 == data.getLength())
+				return;
+			if (CnetworkNode::protocol_udp == node.getProtocol() && data.getLength() > 65507)
+				return;
+			if (m_memoryTrace.isOverHardBudget())
+			{
+				dropOverHardBudget(node, data);
+				return;
+			}
+			postByNode(node, m_memoryTrace._new_throw<__pending_request, tag_pending_request>(m_memoryTrace, node, std::move(data), bAutoConnect));
+		}
+
+		// False when the tcp connection is over the high watermark of write queue.
+		// Data sent is still queued, so stop sending and wait for writable of callback.
+		bool isWritable(const CnetworkNode& node)
+		{
+			if (0 == m_congestedNumber.load(std::memory_order_acquire))
+				return true;
+			__route_shard& shard = m_routes[node.getHash() % s_routeShardNumber];
+			std::lock_guard<std::mutex> guard(shard.m_lock);
+			return shard.m_congested.find(node) == shard.m_congested.end();
+		}
+		bool isWritable(const __connection_handle handle)
+		{
+			if (0 == m_congestedNumber.load(std::memory_order_acquire))
+				return true;
+			__route_shard& shard = m_routes[handle % s_routeShardNumber];
+			std::lock_guard<std::mutex> guard(shard.m_lock);
+			return shard.m_congestedHandles.find(handle) == shard.m_congestedHandles.end();
+		}
+
+		// Send shared data without copy, the data is referenced until written.
+		// Drop of shared data is notified by drop of callback.
+		void send(const CnetworkNode& node, const CsharedBuffer& data, const bool bAutoConnect = false)
+		{
+			if (0 == data.getLength())
+				return;
+			if (CnetworkNode::protocol_udp == node.getProtocol() && data.getLength() > 65507)
+				return;
+			if (m_memoryTrace.isOverHardBudget())
+			{
+				dropOverHardBudget(node, data.getData(), data.getLength());
+				return;
+			}
+			postByNode(node, m_memoryTrace._new_throw<__pending_request, tag_pending_request>(m_memoryTrace, node, data, bAutoConnect));
+		}
+
+		// Send the same data to all nodes, all writes reference one copy of data.
+		void broadcast(const std::vector<CnetworkNode>& nodes, const CsharedBuffer& data, const bool bAutoConnect = false)
+		{
+			for (const auto& node : nodes)
+				send(node, data, bAutoConnect);
+		}
+
+		// Scatter-gather send, all buffers are sent in one write(or one udp packet) without concatenating.
+		// Each buffer is copied.
+		void sendv(const CnetworkNode& node, const uv_buf_t *bufs, const size_t count, const bool bAutoConnect = false)
+		{
+			size_t total = 0;
+			for (size_t i = 0; i < count; ++i)
+				total += bufs[i].len;
+			if (0 == total)
+				return;
+			if (CnetworkNode::protocol_udp == node.getProtocol() && total > 65507)
+				return;
+			if (m_memoryTrace.isOverHardBudget())
+			{
+				for (size_t i = 0; i < count; ++i)
+				{
+					if (bufs[i].len > 0)
+						dropOverHardBudget(node, bufs[i].base, bufs[i].len);
+				}
+				return;
+			}
+			__pending_request *head = nullptr;
+			__pending_request **tail = &head;
+			try
+			{
+				for (size_t i = 0; i < count; ++i)
+				{
+					if (0 == bufs[i].len)
+						continue;
+					*tail = m_memoryTrace._new_throw<__pending_request, tag_pending_request>(m_memoryTrace, node, bufs[i].base, bufs[i].len, bAutoConnect);
+					tail = &(*tail)->m_more;
+				}
+			}
+			catch (...)
+			{
+				freeRequest_set_nullptr(head);
+				throw;
+			}
+			postByNode(node, head);
+		}
+		// Buffers are moved into pool without copy.
+		void sendv(const CnetworkNode& node, std::vector<Cbuffer>&& data, const bool bAutoConnect = false)
+		{
+			size_t total = 0;
+			for (const auto& buffer : data)
+				total += buffer.getLength();
+			if (0 == total)
+				return;
+			if (CnetworkNode::protocol_udp == node.getProtocol() && total > 65507)
+				return;
+			if (m_memoryTrace.isOverHardBudget())
+			{
+				for (auto& buffer : data)
+				{
+					if (buffer.getLength() > 0)
+						dropOverHardBudget(node, buffer);
+				}
+				return;
+			}
+			__pending_request *head = nullptr;
+			__pending_request **tail = &head;
+			try
+			{
+				for (auto& buffer : data)
+				{
+					if (0 == buffer.getLength())
+						continue;
+					*tail = m_memoryTrace._new_throw<__pending_request, tag_pending_request>(m_memoryTrace, node, std::move(buffer), bAutoConnect);
+					tail = &(*tail)->m_more;
+				}
+			}
+			catch (...)
 			{
-				std::lock_guard<std::mutex> guard(m_lock); // Use guard in case of exception.
-				m_pendingSend.push_back(std::move(temp));
+				freeRequest_set_nullptr(head);
+				throw;
 			}
-			uv_async_send(m_wakeup->getAsync());
+			postByNode(node, head);
 		}
 
 		// It waits for pending write requests to complete if bForceClose == false.
@@ -252,12 +682,248 @@ namespace NETWORK_POOL
 		{
 			if (node.getProtocol() != CnetworkNode::protocol_tcp)
 				return; // Only tcp can close.
-			auto&& pair = std::make_pair(node, bForceClose);
+			__pending_request *req = m_memoryTrace._new_throw<__pending_request, tag_pending_request>(m_memoryTrace, __pending_request::request_close, node);
+			req->m_bForceClose = bForceClose;
+			postByNode(node, req);
+		}
+
+		//
+		// Send and close by handle of tcp connection given by callbacks, no lookup by node.
+		// Data sent to a closed connection is dropped(with an empty node), and no auto connect.
+		//
+		void send(const __connection_handle handle, const void *data, const size_t length)
+		{
+			if (0 == length || nullptr == data)
+				return;
+			__loop *loop = getLoopByHandle(handle);
+			if (nullptr == loop)
+				return;
+			if (m_memoryTrace.isOverHardBudget())
 			{
-				std::lock_guard<std::mutex> guard(m_lock); // Use guard in case of exception.
-				m_pendingClose.push_back(pair);
+				m_callback.drop(CnetworkNode(), data, length);
+				return;
 			}
-			uv_async_send(m_wakeup->getAsync());
+			__pending_request *req = m_memoryTrace._new_throw<__pending_request, tag_pending_request>(m_memoryTrace, CnetworkNode(), data, length, false);
+			req->m_handle = handle;
+			post(*loop, req);
+		}
+		void send(const __connection_handle handle, Cbuffer&& data)
+		{
+			if (0 == data.getLength())
+				return;
+			__loop *loop = getLoopByHandle(handle);
+			if (nullptr == loop)
+				return;
+			if (m_memoryTrace.isOverHardBudget())
+			{
+				CnetworkNode empty;
+				m_callback.dropBuffer(empty, data);
+				return;
+			}
+			__pending_request *req = m_memoryTrace._new_throw<__pending_request, tag_pending_request>(m_memoryTrace, CnetworkNode(), std::move(data), false);
+			req->m_handle = handle;
+			post(*loop, req);
+		}
+		void close(const __connection_handle handle, const bool bForceClose = false)
+		{
+			__loop *loop = getLoopByHandle(handle);
+			if (nullptr == loop)
+				return;
+			__pending_request *req = m_memoryTrace._new_throw<__pending_request, tag_pending_request>(m_memoryTrace, __pending_request::request_close, CnetworkNode());
+			req->m_bForceClose = bForceClose;
+			req->m_handle = handle;
+			post(*loop, req);
 		}
 	};
+
+	//
+	// Routing of requests.
+	//
+
+	inline CnetworkPool::__loop& CnetworkPool::getLoopByNode(const CnetworkNode& node)
+	{
+		if (1 == m_loops.size())
+			return *m_loops[0];
+		size_t index = getOwnerIndex(node);
+		if (CnetworkNode::protocol_tcp == node.getProtocol())
+		{
+			__route_shard& shard = m_routes[node.getHash() % s_routeShardNumber];
+			std::lock_guard<std::mutex> guard(shard.m_lock);
+			auto it = shard.m_route.find(node);
+			if (it != shard.m_route.end() && !it->second.m_bClosed)
+				index = it->second.m_index;
+		}
+		return *m_loops[index];
+	}
+
+	inline CnetworkPool::__loop *CnetworkPool::getLoopByHandle(const __connection_handle handle)
+	{
+		size_t index = (size_t)(handle >> s_handleSlotBits) & ((1u << s_handleLoopBits) - 1);
+		if (0 == handle || index >= m_loops.size())
+			return nullptr;
+		return m_loops[index];
+	}
+
+	inline bool CnetworkPool::addRoute(const CnetworkNode& node, const size_t index)
+	{
+		__route_shard& shard = m_routes[node.getHash() % s_routeShardNumber];
+		std::lock_guard<std::mutex> guard(shard.m_lock);
+		__route route = { index, 0, false };
+		return shard.m_route.insert(std::make_pair(node, route)).second; // Fail if the closed one is not released.
+	}
+
+	inline void CnetworkPool::removeRoute(const CnetworkNode& node)
+	{
+		__route_shard& shard = m_routes[node.getHash() % s_routeShardNumber];
+		std::lock_guard<std::mutex> guard(shard.m_lock);
+		shard.m_route.erase(node);
+	}
+
+	// Connection is down, and route is removed after all queued requests are processed.
+	inline void CnetworkPool::closeRoute(const CnetworkNode& node)
+	{
+		__route_shard& shard = m_routes[node.getHash() % s_routeShardNumber];
+		std::lock_guard<std::mutex> guard(shard.m_lock);
+		auto it = shard.m_route.find(node);
+		if (it == shard.m_route.end())
+			return;
+		if (0 == it->second.m_queued)
+			shard.m_route.erase(it);
+		else
+			it->second.m_bClosed = true;
+	}
+
+	// Call after a routed request is processed(and forwarded if needed).
+	inline void CnetworkPool::releaseRoute(const CnetworkNode& node)
+	{
+		__route_shard& shard = m_routes[node.getHash() % s_routeShardNumber];
+		std::lock_guard<std::mutex> guard(shard.m_lock);
+		auto it = shard.m_route.find(node);
+		if (it != shard.m_route.end() && 0 == --it->second.m_queued && it->second.m_bClosed)
+			shard.m_route.erase(it);
+	}
+
+	inline void CnetworkPool::startTimeout(Ctcp *tcp, const unsigned int seconds)
+	{
+		__loop& loop = *obtainLoop(tcp->getTcp()->loop);
+		loop.m_timers.schedule(tcp->getTimeout(), uv_now(&loop.m_loop), (uint64_t)seconds * 1000);
+		if (!uv_is_active((uv_handle_t *)&loop.m_tick))
+			uv_timer_start(&loop.m_tick, on_timer_tick, s_timerTickInMs, s_timerTickInMs); // Never fail on active loop.
+	}
+
+	// Locks of node and handle are taken one by one.
+	inline void CnetworkPool::setCongested(Ctcp *tcp, const bool congested)
+	{
+		if (0 == tcp->getHandle())
+			return; // Not reported to user yet, and handle 0 is never valid.
+		__route_shard& shard = m_routes[tcp->getNode().getHash() % s_routeShardNumber];
+		__route_shard& handleShard = m_routes[tcp->getHandle() % s_routeShardNumber];
+		if (congested)
+		{
+			try
+			{
+				{
+					std::lock_guard<std::mutex> guard(handleShard.m_lock);
+					handleShard.m_congestedHandles.insert(tcp->getHandle());
+				}
+				std::lock_guard<std::mutex> guard(shard.m_lock);
+				shard.m_congested.insert(tcp->getNode());
+			}
+			catch (...)
+			{
+				// Insufficient memory, just treat as writable.
+				std::lock_guard<std::mutex> guard(handleShard.m_lock);
+				handleShard.m_congestedHandles.erase(tcp->getHandle());
+				return;
+			}
+			++m_congestedNumber;
+		}
+		else
+		{
+			{
+				std::lock_guard<std::mutex> guard(handleShard.m_lock);
+				handleShard.m_congestedHandles.erase(tcp->getHandle());
+			}
+			std::lock_guard<std::mutex> guard(shard.m_lock);
+			shard.m_congested.erase(tcp->getNode());
+			--m_congestedNumber;
+		}
+		tcp->setCongested(congested);
+	}
+
+	inline void CnetworkPool::updateWriteWatermark(Ctcp *tcp)
+	{
+		if (0 == m_settings.tcp_write_high_watermark)
+			return;
+		size_t queued = tcp->getStream()->write_queue_size; // Use uv_stream_get_write_queue_size in libuv 1.19.0.
+		if (!tcp->isCongested())
+		{
+			if (queued >= m_settings.tcp_write_high_watermark)
+				setCongested(tcp, true);
+		}
+		else if (queued <= m_settings.tcp_write_low_watermark)
+		{
+			setCongested(tcp, false);
+			m_callback.writable(tcp->getNode(), tcp->getHandle(), tcp->getContext());
+		}
+	}
+
+	inline void CnetworkPool::wakeup(__loop& loop)
+	{
+		if (!loop.m_signaled.exchange(true, std::memory_order_acq_rel))
+			uv_async_send(loop.m_wakeup->getAsync());
+	}
+
+	// Loop may exit when called from other loop or destructor.
+	inline void CnetworkPool::wakeupInternal(__loop& loop)
+	{
+		std::lock_guard<std::mutex> guard(loop.m_lock);
+		if (loop.m_wakeup != nullptr)
+			uv_async_send(loop.m_wakeup->getAsync());
+	}
+
+	inline void CnetworkPool::freeRequest_set_nullptr(__pending_request *& req)
+	{
+		while (req != nullptr)
+		{
+			__pending_request *more = req->m_more;
+			m_memoryTrace._delete_set_nullptr(req);
+			req = more;
+		}
+	}
+
+	inline void CnetworkPool::post(__loop& loop, __pending_request *req)
+	{
+		loop.m_pending.push(req);
+		wakeup(loop);
+	}
+
+	// Request to a routed connection is counted, so the route is kept until it is processed.
+	inline void CnetworkPool::postByNode(const CnetworkNode& node, __pending_request *req)
+	{
+		size_t index = 0;
+		if (m_loops.size() > 1)
+		{
+			index = getOwnerIndex(node);
+			if (CnetworkNode::protocol_tcp == node.getProtocol())
+			{
+				__route_shard& shard = m_routes[node.getHash() % s_routeShardNumber];
+				std::lock_guard<std::mutex> guard(shard.m_lock);
+				auto it = shard.m_route.find(node);
+				if (it != shard.m_route.end())
+				{
+					index = it->second.m_index;
+					++it->second.m_queued;
+					req->m_bRouted = true;
+				}
+			}
+		}
+		post(*m_loops[index], req);
+	}
+
+	inline void CnetworkPool::postInternal(__loop& loop, __pending_request *req)
+	{
+		loop.m_pending.push(req);
+		wakeupInternal(loop); // Request left in queue will be freed when the pool is deleted.
+	}
 }
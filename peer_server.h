@@ -41,22 +41,25 @@ namespace NETWORK_POOL
 		void init()
 		{
 			if (0 == m_buffer.getMaxLength()) // Only init at first time.
+			{
 				m_buffer.resize(0x1000); // 4KB
+				m_buffer.getTrace()->_retag(m_buffer.getData(), tag_receive_buffer);
+			}
 		}
 
 	public:
 		CpeerContext(CmemoryTrace& memoryTrace, const size_t maxBufferSize = 0x1000000) // 16MB
-			:m_maxBufferSize(maxBufferSize), m_buffer(memoryTrace), m_nowIndex(0) {}
+			:m_maxBufferSize(maxBufferSize), m_buffer(&memoryTrace), m_nowIndex(0) {}
 
-		void prepareBuffer(void *& buffer, size_t& lenght)
+		void prepareBuffer(void *& buffer, size_t& length)
 		{
 			init();
 			if (m_buffer.getLength() - m_nowIndex < 0x800) // 2KB
 			{
-				if (m_buffer.getLength() * 2 > m_maxBufferSize)
-					m_buffer.resize(m_maxBufferSize, m_nowIndex);
-				else
-					m_buffer.resize(m_buffer.getLength() * 2, m_nowIndex);
+				// Buffer grows geometrically, so just ask for 2KB more and take all the capacity.
+				m_buffer.reserve(m_buffer.getLength() + 0x800 > m_maxBufferSize ? m_maxBufferSize : m_buffer.getLength() + 0x800, m_maxBufferSize);
+				m_buffer.resize(m_buffer.getMaxLength() > m_maxBufferSize ? m_maxBufferSize : m_buffer.getMaxLength());
+				m_buffer.getTrace()->_retag(m_buffer.getData(), tag_receive_buffer);
 			}
 			length = m_buffer.getLength() - m_nowIndex;
 			if (0 == length)
@@ -82,7 +85,7 @@ namespace NETWORK_POOL
 				if (m_nowIndex < nowCheck + sizeof(uint32_t) + packLength)
 					break;
 				// Copy to buffer.
-				buffers.push_back(Cbuffer((const unsigned char *)m_buffer.getData() + nowCheck + sizeof(uint32_t), packLength));
+				buffers.push_back(Cbuffer(m_buffer.getTrace(), (const unsigned char *)m_buffer.getData() + nowCheck + sizeof(uint32_t), packLength));
 				nowCheck += sizeof(uint32_t) + packLength;
 			}
 			if (nowCheck > 0)
@@ -92,11 +95,18 @@ namespace NETWORK_POOL
 				unsigned char *ptr = (unsigned char *)m_buffer.getData();
 				memmove(ptr, ptr + nowCheck, extra);
 				m_nowIndex = extra;
+				// Give back memory of large message, so idle connection only holds 4KB.
+				if (m_buffer.getLength() > 0x1000 && m_nowIndex <= 0x800)
+				{
+					m_buffer.resize(0x1000);
+					m_buffer.shrinkToFit();
+					m_buffer.getTrace()->_retag(m_buffer.getData(), tag_receive_buffer);
+				}
 			}
 		}
 
 		// For udp decode.
-		static void getContent(const void *data, const size_t length, std::vector<Cbuffer>& buffers)
+		static void getContent(CmemoryTrace& memoryTrace, const void *data, const size_t length, std::vector<Cbuffer>& buffers)
 		{
 			size_t nowCheck = 0;
 			while (true)
@@ -107,7 +117,7 @@ namespace NETWORK_POOL
 				if (length < nowCheck + sizeof(uint32_t) + packLength)
 					break;
 				// Copy to buffer.
-				buffers.push_back(Cbuffer((const unsigned char *)data + nowCheck + sizeof(uint32_t), packLength));
+				buffers.push_back(Cbuffer(&memoryTrace, (const unsigned char *)data + nowCheck + sizeof(uint32_t), packLength));
 				nowCheck += sizeof(uint32_t) + packLength;
 			}
 		}
@@ -119,8 +129,6 @@ namespace NETWORK_POOL
 		CmemoryTrace& m_memoryTrace;
 		CnetworkPool *m_pool;
 
-		std::unordered_map<CnetworkNode, CpeerContext, __network_hash> m_tcpContext;
-
 	public:
 		CpeerServer(CmemoryTrace& memoryTrace)
 			:m_memoryTrace(memoryTrace), m_pool(nullptr) {}
@@ -134,45 +142,54 @@ namespace NETWORK_POOL
 			return m_pool;
 		}
 
+		// Set tcp_context_size of pool to this, so context is allocated with connection.
+		static size_t getTcpContextSize()
+		{
+			return sizeof(CpeerContext);
+		}
+
+		// Udp packet.
 		void allocateMemoryForMessage(const CnetworkNode& node, size_t suggestedSize, void *& buffer, size_t& lenght)
 		{
-			if (CnetworkNode::protocol_udp == node.getProtocol())
-			{
-				// Udp packet.
-				buffer = m_memoryTrace._malloc_no_throw(suggestedSize);
-				if (buffer != nullptr)
-					lenght = suggestedSize;
-				else
-					lenght = 0;
-			}
+			buffer = m_memoryTrace._malloc_no_throw(suggestedSize, tag_receive_buffer);
+			if (buffer != nullptr)
+				lenght = suggestedSize;
 			else
-			{
-				auto it = m_tcpContext.find(node);
-				if (it != m_tcpContext.end())
-					it->second.prepareBuffer(buffer, lenght); // Tcp.
-			}
+				lenght = 0;
 		}
 		void deallocateMemoryForMessage(const CnetworkNode& node, void *buffer, size_t lenght)
 		{
-			if (CnetworkNode::protocol_udp == node.getProtocol())
-				m_memoryTrace._free_set_nullptr(buffer); // Udp packet.
+			m_memoryTrace._free_set_nullptr(buffer);
 		}
-
 		void message(const CnetworkNode& node, const void *data, const size_t length)
 		{
 			std::vector<Cbuffer> buffers;
-			if (CnetworkNode::protocol_udp == node.getProtocol())
-				CpeerContext::getContent(data, length, buffers); // Udp packet.
-			else
+			CpeerContext::getContent(m_memoryTrace, data, length, buffers);
+			dealContent(buffers);
+		}
+
+		// Tcp.
+		void allocateMemoryForMessage(const CnetworkNode& node, const __connection_handle handle, void *context, size_t suggestedSize, void *& buffer, size_t& lenght)
+		{
+			CpeerContext *ctx = (CpeerContext *)context;
+			if (ctx != nullptr)
+				ctx->prepareBuffer(buffer, lenght);
+		}
+		void deallocateMemoryForMessage(const CnetworkNode& node, const __connection_handle handle, void *context, void *buffer, size_t lenght) {}
+		void message(const CnetworkNode& node, const __connection_handle handle, void *context, const void *data, const size_t length)
+		{
+			std::vector<Cbuffer> buffers;
+			CpeerContext *ctx = (CpeerContext *)context;
+			if (ctx != nullptr)
 			{
-				auto it = m_tcpContext.find(node);
-				if (it != m_tcpContext.end())
-				{
-					ChttpContext& ctx = it->second;
-					ctx.recvPush(length);
-					ctx.getContent(buffers);
-				}
+				ctx->pushBuffer(length);
+				ctx->getContent(buffers);
 			}
+			dealContent(buffers);
+		}
+
+		void dealContent(std::vector<Cbuffer>& buffers)
+		{
 			for (auto& buffer : buffers)
 			{
 				// Dealing with content.
@@ -183,12 +200,41 @@ namespace NETWORK_POOL
 		void drop(const CnetworkNode& node, const void *data, const size_t length) {}
 
 		void bindStatus(const CnetworkNode& node, const bool bSuccess) {}
-		void connectionStatus(const CnetworkNode& node, const bool bSuccess)
+		void connectionStatus(const CnetworkNode& node, const bool bSuccess) {}
+		void connectionStatus(const CnetworkNode& node, const __connection_handle handle, void *& context, const bool bSuccess)
 		{
+			if (0 == handle)
+			{
+				// No handle, just close.
+				if (bSuccess && m_pool != nullptr)
+					m_pool->close(node);
+				return;
+			}
+			// Construct in storage of connection if large enough.
+			const bool bInline = m_pool != nullptr && m_pool->getSettings().tcp_context_size >= sizeof(CpeerContext);
 			if (bSuccess)
-				m_tcpContext.insert(std::make_pair(node, CpeerContext(m_memoryTrace)));
+			{
+				if (bInline)
+					context = new (context)CpeerContext(m_memoryTrace);
+				else
+				{
+					context = m_memoryTrace._new_no_throw<CpeerContext, tag_context>(m_memoryTrace);
+					if (nullptr == context && m_pool != nullptr)
+						m_pool->close(handle);
+				}
+			}
 			else
-				m_tcpContext.erase(node);
+			{
+				CpeerContext *ctx = (CpeerContext *)context;
+				if (bInline)
+				{
+					if (ctx != nullptr)
+						ctx->~CpeerContext();
+				}
+				else
+					m_memoryTrace._delete_set_nullptr(ctx);
+				context = nullptr;
+			}
 		}
 	};
 }
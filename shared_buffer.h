@@ -0,0 +1,132 @@
+/* Copyright (c) 2018 Zhenyu Zhang. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstring>
+
+#include "memory_trace.h"
+
+namespace NETWORK_POOL
+{
+	//
+	// Immutable reference counted buffer, for sending the same data to many nodes without copy.
+	// Data is freed when the last reference(user handle or pending write) is released.
+	//
+	class CsharedBuffer
+	{
+	public:
+		struct __block
+		{
+			std::atomic<size_t> m_ref;
+			CmemoryTrace *m_trace; // Block may outlive the handle, so keep the trace here.
+			size_t m_length;
+
+			inline char *getData()
+			{
+				return (char *)(this + 1);
+			}
+		};
+
+	private:
+		__block *m_block;
+
+		friend class CnetworkPool;
+
+		inline __block *retain() const // Internal use only.
+		{
+			if (m_block != nullptr)
+				m_block->m_ref.fetch_add(1, std::memory_order_relaxed);
+			return m_block;
+		}
+
+		static inline void release_set_nullptr(__block *& block) // Internal use only.
+		{
+			if (nullptr == block)
+				return;
+			if (1 == block->m_ref.fetch_sub(1, std::memory_order_acq_rel))
+			{
+				CmemoryTrace *trace = block->m_trace;
+				trace->_free_set_nullptr(block);
+			}
+			block = nullptr;
+		}
+
+	public:
+		CsharedBuffer()
+			:m_block(nullptr) {}
+		CsharedBuffer(CmemoryTrace *trace, const void *data, const size_t length)
+			:m_block(nullptr)
+		{
+			if (0 == length)
+				return;
+			if (sizeof(__block) + length < length) // In case of overflow.
+				throw std::bad_alloc();
+			m_block = (__block *)trace->_malloc_throw(sizeof(__block) + length, tag_send_payload);
+			new (&m_block->m_ref) std::atomic<size_t>(1);
+			m_block->m_trace = trace;
+			m_block->m_length = length;
+			memcpy(m_block->getData(), data, length);
+		}
+		CsharedBuffer(const CsharedBuffer& another)
+			:m_block(another.retain()) {}
+		CsharedBuffer(CsharedBuffer&& another)
+			:m_block(another.m_block)
+		{
+			another.m_block = nullptr;
+		}
+		~CsharedBuffer()
+		{
+			release_set_nullptr(m_block);
+		}
+
+		const CsharedBuffer& operator=(const CsharedBuffer& another)
+		{
+			if (m_block != another.m_block)
+			{
+				__block *block = another.retain();
+				release_set_nullptr(m_block);
+				m_block = block;
+			}
+			return *this;
+		}
+		const CsharedBuffer& operator=(CsharedBuffer&& another)
+		{
+			if (this != &another)
+			{
+				release_set_nullptr(m_block);
+				m_block = another.m_block;
+				another.m_block = nullptr;
+			}
+			return *this;
+		}
+
+		inline const void *getData() const
+		{
+			return nullptr == m_block ? nullptr : m_block->getData();
+		}
+		inline size_t getLength() const
+		{
+			return nullptr == m_block ? 0 : m_block->m_length;
+		}
+	};
+}
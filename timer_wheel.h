@@ -0,0 +1,186 @@
+/* Copyright (c) 2018 Zhenyu Zhang. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace NETWORK_POOL
+{
+	class CtimerWheel;
+
+	struct __timer_node
+	{
+		__timer_node *m_prev;
+		__timer_node *m_next;
+		CtimerWheel *m_wheel; // nullptr if not scheduled.
+		uint64_t m_deadline; // Tick to expire.
+		uint64_t m_expire; // Tick of the slot linked, may be earlier than deadline(reset lazily).
+
+		inline void init()
+		{
+			m_prev = m_next = this;
+			m_wheel = nullptr;
+			m_deadline = m_expire = 0;
+		}
+		inline bool scheduled() const
+		{
+			return m_wheel != nullptr;
+		}
+	};
+
+	//
+	// Hashed timer wheel, driven by one timer of loop.
+	// Reset to a later deadline only updates the deadline, and the node is moved when its slot is reached.
+	// Must be used in one thread.
+	//
+	class CtimerWheel
+	{
+	public:
+		typedef void (*__expire_cb)(__timer_node *node);
+
+	private:
+		static const size_t s_slotNumber = 512; // Power of 2.
+
+		std::vector<__timer_node> m_slots; // Sentinel of each slot.
+		uint64_t m_current; // Tick dealt.
+		uint64_t m_tickInMs;
+		size_t m_count;
+		__expire_cb m_cb;
+
+		static inline void unlink(__timer_node *node)
+		{
+			node->m_prev->m_next = node->m_next;
+			node->m_next->m_prev = node->m_prev;
+			node->m_prev = node->m_next = node;
+		}
+		static inline void pushBack(__timer_node *head, __timer_node *node)
+		{
+			node->m_prev = head->m_prev;
+			node->m_next = head;
+			head->m_prev->m_next = node;
+			head->m_prev = node;
+		}
+		inline void link(__timer_node *node)
+		{
+			node->m_expire = node->m_deadline > m_current ? node->m_deadline : m_current + 1;
+			pushBack(&m_slots[node->m_expire & (s_slotNumber - 1)], node);
+		}
+
+	public:
+		CtimerWheel(const uint64_t tickInMs, __expire_cb cb)
+			:m_slots(s_slotNumber), m_current(0), m_tickInMs(tickInMs), m_count(0), m_cb(cb)
+		{
+			for (auto& slot : m_slots)
+				slot.init();
+		}
+
+		// No copy, no move.
+		CtimerWheel(const CtimerWheel& another) = delete;
+		CtimerWheel(CtimerWheel&& another) = delete;
+		const CtimerWheel& operator=(const CtimerWheel& another) = delete;
+		const CtimerWheel& operator=(CtimerWheel&& another) = delete;
+
+		inline uint64_t getTickInMs() const
+		{
+			return m_tickInMs;
+		}
+		inline bool empty() const
+		{
+			return 0 == m_count;
+		}
+
+		// Must be called before any schedule.
+		inline void reset(const uint64_t nowInMs)
+		{
+			m_current = nowInMs / m_tickInMs;
+		}
+
+		inline void schedule(__timer_node *node, const uint64_t nowInMs, const uint64_t timeoutInMs)
+		{
+			uint64_t deadline = (nowInMs + timeoutInMs + m_tickInMs - 1) / m_tickInMs;
+			if (0 == m_count && nowInMs / m_tickInMs > m_current)
+				m_current = nowInMs / m_tickInMs; // Ticker is stopped when empty, so skip the ticks missed.
+			if (!node->scheduled())
+			{
+				node->m_wheel = this;
+				node->m_deadline = deadline;
+				link(node);
+				++m_count;
+			}
+			else if (deadline >= node->m_expire)
+				node->m_deadline = deadline; // O(1) reset, moved when slot reached.
+			else
+			{
+				unlink(node);
+				node->m_deadline = deadline;
+				link(node);
+			}
+		}
+
+		static inline void cancel(__timer_node *node)
+		{
+			if (!node->scheduled())
+				return;
+			unlink(node);
+			--node->m_wheel->m_count;
+			node->m_wheel = nullptr;
+		}
+
+		// Expire callback can schedule or cancel any node.
+		void advance(const uint64_t nowInMs)
+		{
+			uint64_t now = nowInMs / m_tickInMs;
+			while (m_current < now && m_count > 0)
+			{
+				++m_current;
+				// Move out the slot, so nodes rescheduled to this slot are not visited again.
+				__timer_node pending;
+				pending.init();
+				__timer_node *head = &m_slots[m_current & (s_slotNumber - 1)];
+				while (head->m_next != head)
+				{
+					__timer_node *node = head->m_next;
+					unlink(node);
+					pushBack(&pending, node);
+				}
+				while (pending.m_next != &pending)
+				{
+					__timer_node *node = pending.m_next;
+					unlink(node);
+					if (node->m_expire > m_current)
+						pushBack(head, node); // Next round.
+					else if (node->m_deadline > m_current)
+						link(node); // Reset lazily.
+					else
+					{
+						node->m_wheel = nullptr;
+						--m_count;
+						m_cb(node);
+					}
+				}
+			}
+			if (m_current < now)
+				m_current = now; // Nothing scheduled, just catch up.
+		}
+	};
+}
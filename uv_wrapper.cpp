@@ -31,7 +31,7 @@ namespace NETWORK_POOL
 
 	Casync *Casync::alloc(CnetworkPool *pool, uv_loop_t *loop, uv_async_cb cb)
 	{
-		Casync *async = pool->getMemoryTrace()._new_no_throw<Casync>();
+		Casync *async = pool->getMemoryTrace()._new_no_throw<Casync, tag_connection>();
 		if (nullptr == async)
 			return nullptr;
 		async->m_inited = false;
@@ -97,25 +97,26 @@ namespace NETWORK_POOL
 		return true;
 	}
 
-	Ctcp *Ctcp::alloc(CnetworkPool *pool, uv_loop_t *loop, bool initTimer)
+	Ctcp *Ctcp::alloc(CnetworkPool *pool, uv_loop_t *loop, const size_t contextSize)
 	{
-		Ctcp *tcp = pool->getMemoryTrace()._new_no_throw<Ctcp>();
-		if (nullptr == tcp)
+		// Context storage is allocated together.
+		if (sizeof(Ctcp) + contextSize < contextSize)
 			return nullptr;
+		void *ptr = pool->getMemoryTrace()._malloc_no_throw(sizeof(Ctcp) + contextSize, tag_connection);
+		if (nullptr == ptr)
+			return nullptr;
+		Ctcp *tcp = new (ptr)Ctcp();
+		tcp->m_timeout.init();
 		tcp->m_tcpInited = false;
-		tcp->m_timerInited = false;
 		tcp->m_closing = false;
 		tcp->m_shutdown = false;
+		tcp->m_congested = false;
 		tcp->m_pool = pool;
+		tcp->m_handle = 0;
+		tcp->m_context = nullptr;
 		if (uv_tcp_init(loop, &tcp->m_tcp) != 0)
 			goto _ec;
 		tcp->m_tcpInited = true;
-		if (initTimer)
-		{
-			if (uv_timer_init(loop, &tcp->m_timer) != 0)
-				goto _ec;
-			tcp->m_timerInited = true;
-		}
 		if (!setTcp(&tcp->m_tcp, pool->getSettings()))
 			goto _ec;
 		return tcp;
@@ -126,28 +127,17 @@ namespace NETWORK_POOL
 
 	void Ctcp::close_set_nullptr(Ctcp *& tcp)
 	{
-		if (tcp->m_tcpInited || tcp->m_timerInited)
+		CtimerWheel::cancel(&tcp->m_timeout); // No timeout after close.
+		if (tcp->m_tcpInited)
 		{
 			if (!tcp->m_closing)
 			{
-				// Both close callback should be set if initialized.
-				if (tcp->m_tcpInited)
-					uv_close((uv_handle_t *)&tcp->m_tcp,
+				uv_close((uv_handle_t *)&tcp->m_tcp,
 					[](uv_handle_t *handle)
 				{
 					Ctcp *tcp = Ctcp::obtainFromTcp(handle);
 					tcp->m_tcpInited = false;
-					if (!tcp->m_timerInited)
-						tcp->m_pool->getMemoryTrace()._delete_set_nullptr<Ctcp>(tcp);
-				});
-				if (tcp->m_timerInited)
-					uv_close((uv_handle_t *)&tcp->m_timer,
-					[](uv_handle_t *handle)
-				{
-					Ctcp *tcp = Ctcp::obtainFromTimer(handle);
-					tcp->m_timerInited = false;
-					if (!tcp->m_tcpInited)
-						tcp->m_pool->getMemoryTrace()._delete_set_nullptr<Ctcp>(tcp);
+					tcp->m_pool->getMemoryTrace()._delete_set_nullptr<Ctcp>(tcp);
 				});
 				tcp->m_closing = true;
 			}
@@ -163,7 +153,7 @@ namespace NETWORK_POOL
 			goto _ec;
 		if (!tcp->m_closing && !tcp->m_shutdown)
 		{
-			uv_shutdown_t *shutdown = (uv_shutdown_t *)tcp->m_pool->getMemoryTrace()._malloc_no_throw(sizeof(uv_shutdown_t));
+			uv_shutdown_t *shutdown = (uv_shutdown_t *)tcp->m_pool->getMemoryTrace()._malloc_no_throw(sizeof(uv_shutdown_t), tag_connection);
 			if (nullptr == shutdown)
 				goto _ec;
 			if (uv_shutdown(shutdown, (uv_stream_t *)&tcp->m_tcp,
@@ -197,7 +187,7 @@ namespace NETWORK_POOL
 
 	Cudp *Cudp::alloc(CnetworkPool *pool, uv_loop_t *loop)
 	{
-		Cudp *udp = pool->getMemoryTrace()._new_no_throw<Cudp>();
+		Cudp *udp = pool->getMemoryTrace()._new_no_throw<Cudp, tag_connection>();
 		if (nullptr == udp)
 			return nullptr;
 		udp->m_inited = false;
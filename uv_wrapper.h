@@ -24,6 +24,7 @@
 #include "uv.h"
 
 #include "network_node.h"
+#include "timer_wheel.h"
 
 namespace NETWORK_POOL
 {
@@ -83,18 +84,21 @@ namespace NETWORK_POOL
 		PRIVATE_CLASS(Ctcp)
 	private:
 		uv_tcp_t m_tcp;
-		uv_timer_t m_timer;
+		__timer_node m_timeout; // Scheduled on timer wheel of loop.
 		bool m_tcpInited;
-		bool m_timerInited;
 		bool m_closing;
 		bool m_shutdown;
+		bool m_congested; // Write queue over high watermark.
 		CnetworkPool *m_pool;
 		CnetworkNode m_node;
+		__connection_handle m_handle; // Assigned when connection startup.
+		void *m_context; // Set by user when connection startup.
+		// Context storage(tcp_context_size bytes) follows.
 
 		friend class CmemoryTrace;
 
 	public:
-		static Ctcp *alloc(CnetworkPool *pool, uv_loop_t *loop, bool initTimer = true);
+		static Ctcp *alloc(CnetworkPool *pool, uv_loop_t *loop, const size_t contextSize = 0);
 		static void close_set_nullptr(Ctcp *& tcp);
 
 		// Wait send finish, shutdown and close.
@@ -104,10 +108,6 @@ namespace NETWORK_POOL
 		{
 			return container_of(handle, Ctcp, m_tcp);
 		}
-		static inline Ctcp *obtainFromTimer(uv_handle_t *handle)
-		{
-			return container_of(handle, Ctcp, m_timer);
-		}
 		static inline Ctcp *obtain(uv_stream_t *stream)
 		{
 			return container_of(stream, Ctcp, m_tcp);
@@ -116,9 +116,9 @@ namespace NETWORK_POOL
 		{
 			return container_of(tcp, Ctcp, m_tcp);
 		}
-		static inline Ctcp *obtain(uv_timer_t *timer)
+		static inline Ctcp *obtain(__timer_node *timeout)
 		{
-			return container_of(timer, Ctcp, m_timer);
+			return container_of(timeout, Ctcp, m_timeout);
 		}
 
 		inline uv_tcp_t *getTcp()
@@ -129,9 +129,9 @@ namespace NETWORK_POOL
 		{
 			return (uv_stream_t *)&m_tcp;
 		}
-		inline uv_timer_t *getTimer()
+		inline __timer_node *getTimeout()
 		{
-			return &m_timer;
+			return &m_timeout;
 		}
 		inline CnetworkPool *getPool() const
 		{
@@ -141,6 +141,22 @@ namespace NETWORK_POOL
 		{
 			return m_node;
 		}
+		inline __connection_handle getHandle() const
+		{
+			return m_handle;
+		}
+		inline void setHandle(const __connection_handle handle)
+		{
+			m_handle = handle;
+		}
+		inline void *& getContext()
+		{
+			return m_context;
+		}
+		inline void *getContextStorage()
+		{
+			return this + 1;
+		}
 
 		inline bool isClosing() const
 		{
@@ -150,6 +166,15 @@ namespace NETWORK_POOL
 		{
 			return m_shutdown;
 		}
+
+		inline bool isCongested() const
+		{
+			return m_congested;
+		}
+		inline void setCongested(const bool congested)
+		{
+			m_congested = congested;
+		}
 	};
 
 	class Cudp